@@ -0,0 +1,105 @@
+# lmh_embed_resources(<target> <dir> [NAMESPACE <ns>])
+#
+# Turns every file under <dir> into constexpr byte array and generates sorted lookup table
+# of lmh::EmbeddedResource, served by lmh::EmbeddedResourceController.
+# Generated header is "lmh_embedded_resources.hpp", table is <ns>::resources (default lmh::embedded).
+#
+# Same file is used in script mode (cmake -P) to generate the header at build time.
+
+if(NOT CMAKE_SCRIPT_MODE_FILE)
+
+    set(LMH_EMBED_SCRIPT ${CMAKE_CURRENT_LIST_FILE})
+
+    function(lmh_embed_resources target dir)
+        cmake_parse_arguments(EMBED "" "NAMESPACE" "" ${ARGN})
+        if(NOT EMBED_NAMESPACE)
+            set(EMBED_NAMESPACE "lmh::embedded")
+        endif()
+
+        get_filename_component(dir ${dir} ABSOLUTE)
+        file(GLOB_RECURSE files LIST_DIRECTORIES false CONFIGURE_DEPENDS ${dir}/*)
+
+        set(out_dir ${CMAKE_CURRENT_BINARY_DIR}/lmh_embed/${target})
+        set(out ${out_dir}/lmh_embedded_resources.hpp)
+
+        add_custom_command(
+                OUTPUT ${out}
+                COMMAND ${CMAKE_COMMAND} -DLMH_EMBED_DIR=${dir} -DLMH_EMBED_OUT=${out}
+                        -DLMH_EMBED_NAMESPACE=${EMBED_NAMESPACE} -P ${LMH_EMBED_SCRIPT}
+                DEPENDS ${files} ${LMH_EMBED_SCRIPT}
+                COMMENT "Embedding resources from ${dir} into ${target}"
+                VERBATIM)
+
+        target_sources(${target} PRIVATE ${out})
+        target_include_directories(${target} PRIVATE ${out_dir})
+    endfunction()
+
+    return()
+endif()
+
+# script mode: LMH_EMBED_DIR, LMH_EMBED_OUT, LMH_EMBED_NAMESPACE
+
+file(GLOB_RECURSE files LIST_DIRECTORIES false RELATIVE ${LMH_EMBED_DIR} ${LMH_EMBED_DIR}/*)
+list(SORT files)
+
+set(arrays "")
+set(entries "")
+set(index 0)
+string(REPEAT "0x[0-9a-f][0-9a-f]," 16 row)
+
+foreach(rel ${files})
+    file(READ ${LMH_EMBED_DIR}/${rel} content HEX)
+    file(SIZE ${LMH_EMBED_DIR}/${rel} size)
+
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," content "${content}")
+    string(REGEX REPLACE "(${row})" "\\1\n        " content "${content}")
+
+    # trailing NUL keeps empty files valid arrays, it's not counted in size
+    string(APPEND arrays "    // ${rel}\n    inline constexpr unsigned char res_${index}[] = {\n        ${content}0x00 };\n\n")
+    list(APPEND entries "/${rel}")
+    set("res_of_/${rel}" "res_${index}, ${size}")
+
+    # directory index is reachable by directory path too
+    if(rel MATCHES "(^|/)index\\.html$")
+        string(REGEX REPLACE "index\\.html$" "" dir_path "${rel}")
+        list(APPEND entries "/${dir_path}")
+        set("res_of_/${dir_path}" "res_${index}, ${size}")
+    endif()
+
+    math(EXPR index "${index} + 1")
+endforeach()
+
+# lookup is binary search, table must be sorted by path
+list(SORT entries)
+
+set(table "")
+foreach(path ${entries})
+    string(APPEND table "        { \"${path}\", ${res_of_${path}} },\n")
+endforeach()
+
+if(NOT entries)
+    # zero-sized arrays are not allowed, keep one never matching entry
+    set(table "        { \"\", nullptr, 0 },\n")
+endif()
+
+file(WRITE ${LMH_EMBED_OUT}.tmp
+"// generated by lmh_embed_resources() from ${LMH_EMBED_DIR}, do not edit
+
+#pragma once
+
+#include <lmhttpd_embed.hpp>
+
+namespace ${LMH_EMBED_NAMESPACE} {
+
+${arrays}    inline constexpr lmh::EmbeddedResource resources[] = {
+${table}    };
+
+    constexpr lmh::EmbeddedResource const* find(std::string_view path) {
+        return lmh::find_resource(resources, path);
+    }
+}
+")
+
+# don't touch the header if nothing changed, it would rebuild dependants
+execute_process(COMMAND ${CMAKE_COMMAND} -E copy_if_different ${LMH_EMBED_OUT}.tmp ${LMH_EMBED_OUT})
+file(REMOVE ${LMH_EMBED_OUT}.tmp)
@@ -0,0 +1,17 @@
+//
+// Serves files from examples/assets compiled into the binary by lmh_embed_resources().
+//
+
+#include <lmhttpd_embed.hpp>
+#include <lmh_embedded_resources.hpp>
+
+using namespace lmh;
+
+static_assert(embedded::find("/index.html") != nullptr, "index.html is embedded");
+
+int main(int argc, char** argv){
+
+    WebServer server(8080);
+    server.addController(std::make_shared<EmbeddedResourceController>(embedded::resources));
+    server.start();
+}
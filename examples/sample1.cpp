@@ -9,22 +9,23 @@ using namespace lmh;
 
 class MyController:public DynamicController {
 public:
-    bool validPath(const char* path, const char* method) override {
-        if(strcmp(path, "/") == 0 && strcmp("GET", method) == 0){
-            return true;
-        }
-        return false;
+    MethodSet methods() const override { return Method::GET; }
+
+    bool validRoute(const char* path, Method method) override {
+        return strcmp(path, "/") == 0;
     }
 
-    void createResponse(struct MHD_Connection * connection,
+    ResponseParams createResponse(struct MHD_Connection * connection,
                                 const char * url, const char * method, const char * upload_data,
-                                size_t * upload_data_size, std::stringstream& response) override {
+                                size_t * upload_data_size, void** ptr, std::stringstream& response) override {
 
         time_t time_cur;
         time(&time_cur);
         struct tm* time_now = localtime(&time_cur);
         response << "<html><head><title>Hello World from cpp</title></head><body>Hello World at "
                  << time_now->tm_hour << ":" << time_now->tm_min << ":" << time_now->tm_sec << "!</body></html>";
+
+        return ResponseParams();
     }
 
 };
@@ -32,9 +33,9 @@ public:
 
 int main(int argc, char** argv){
 
-    MyController myPage;
+    auto myPage = std::make_shared<MyController>();
 
     WebServer server(8080);
-    server.addController(&myPage);
+    server.addController(myPage);
     server.start();
 }
\ No newline at end of file
@@ -34,46 +34,1066 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define LMHTTPD_HPP
 
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <microhttpd.h>
 
 #include <memory>
 #include <iostream>
 #include <cstring>
+#include <cerrno>
 #include <vector>
 #include <sstream>
 #include <optional>
 #include <functional>
+#include <deque>
+#include <string_view>
+#include <algorithm>
+#include <cctype>
+#include <ctime>
+#include <array>
+#include <memory_resource>
+#include <typeinfo>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <atomic>
+#include <unordered_map>
+#include <chrono>
+#include <fstream>
+#include <utility>
 
 namespace lmh {
 
+    /**
+     * FNV-1a 64bit hash, cheap non-cryptographic hash used for ETags.
+     */
+    constexpr uint64_t fnv1a(std::string_view data, uint64_t hash = 0xcbf29ce484222325ULL) {
+        for(auto c: data) {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    /**
+     * Guess content type from file name extension, defaults to application/octet-stream.
+     */
+    inline std::string_view mime_type(std::string_view path) {
+        static constexpr std::pair<std::string_view, std::string_view> types[] = {
+                { "html", "text/html; charset=utf-8" },
+                { "htm", "text/html; charset=utf-8" },
+                { "css", "text/css; charset=utf-8" },
+                { "js", "application/javascript; charset=utf-8" },
+                { "mjs", "application/javascript; charset=utf-8" },
+                { "json", "application/json" },
+                { "map", "application/json" },
+                { "txt", "text/plain; charset=utf-8" },
+                { "xml", "application/xml" },
+                { "svg", "image/svg+xml" },
+                { "png", "image/png" },
+                { "jpg", "image/jpeg" },
+                { "jpeg", "image/jpeg" },
+                { "gif", "image/gif" },
+                { "webp", "image/webp" },
+                { "ico", "image/x-icon" },
+                { "woff", "font/woff" },
+                { "woff2", "font/woff2" },
+                { "wasm", "application/wasm" },
+                { "pdf", "application/pdf" },
+        };
+        constexpr std::string_view fallback = "application/octet-stream";
+
+        auto const dot = path.rfind('.');
+        if(dot == std::string_view::npos or path.find('/', dot) != std::string_view::npos)
+            return fallback;
+
+        auto const ext = path.substr(dot + 1);
+        for(auto const& [e, type]: types) {
+            if(e.size() == ext.size() and
+               std::equal(e.begin(), e.end(), ext.begin(), [](char a, char b) { return a == std::tolower(static_cast<unsigned char>(b)); })) {
+                return type;
+            }
+        }
+        return fallback;
+    }
+
+    /**
+     * Check if Accept-Encoding header value allows given content coding (ignores q-values except q=0).
+     */
+    inline bool accepts_encoding(const char* header, std::string_view coding) {
+        if(not header) return false;
+
+        std::string_view rest(header);
+        while(not rest.empty()) {
+            auto const comma = rest.find(',');
+            auto item = rest.substr(0, comma);
+            rest = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
+
+            auto const semi = item.find(';');
+            auto params = semi == std::string_view::npos ? std::string_view() : item.substr(semi + 1);
+            auto name = item.substr(0, semi);
+            while(not name.empty() and name.front() == ' ') name.remove_prefix(1);
+            while(not name.empty() and name.back() == ' ') name.remove_suffix(1);
+
+            if(name.size() != coding.size() or
+               not std::equal(name.begin(), name.end(), coding.begin(),
+                              [](char a, char b) { return std::tolower(static_cast<unsigned char>(a)) == b; })) {
+                continue;
+            }
+
+            auto const q = params.find("q=");
+            if(q != std::string_view::npos) {
+                auto qv = params.substr(q + 2);
+                // q=0, q=0.0, q=0.000 refuse the coding
+                if(not qv.empty() and qv.front() == '0' and qv.find_first_of("123456789") == std::string_view::npos)
+                    return false;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * Inclusive byte range, resolved against entity size.
+     */
+    struct ByteRange {
+        uint64_t first = 0;
+        uint64_t last = 0;
+
+        uint64_t length() const { return last - first + 1; }
+    };
+
+    /**
+     * Parses Range header value for entity of given size.
+     * Returns nullopt if the header should be ignored (missing, malformed, not bytes, too many ranges),
+     * empty vector if no range is satisfiable (416).
+     */
+    inline std::optional<std::vector<ByteRange>> parse_range(const char* header, uint64_t size, size_t max_ranges = 16) {
+        if(not header) return std::nullopt;
+
+        std::string_view rest(header);
+        constexpr std::string_view unit = "bytes=";
+        if(rest.compare(0, unit.size(), unit) != 0) return std::nullopt;
+        rest.remove_prefix(unit.size());
+
+        auto number = [](std::string_view s, uint64_t& out) {
+            if(s.empty() or s.size() > 19) return false;
+            out = 0;
+            for(auto c: s) {
+                if(c < '0' or c > '9') return false;
+                out = out * 10 + static_cast<uint64_t>(c - '0');
+            }
+            return true;
+        };
+
+        std::vector<ByteRange> ranges;
+        size_t specs = 0;
+        while(not rest.empty()) {
+            auto const comma = rest.find(',');
+            auto spec = rest.substr(0, comma);
+            rest = comma == std::string_view::npos ? std::string_view() : rest.substr(comma + 1);
+
+            while(not spec.empty() and spec.front() == ' ') spec.remove_prefix(1);
+            while(not spec.empty() and spec.back() == ' ') spec.remove_suffix(1);
+            if(spec.empty()) continue;
+
+            if(++specs > max_ranges) return std::nullopt;
+
+            auto const dash = spec.find('-');
+            if(dash == std::string_view::npos) return std::nullopt;
+
+            uint64_t first = 0;
+            uint64_t last = 0;
+            if(dash == 0) {
+                // suffix range: last N bytes
+                if(not number(spec.substr(1), last)) return std::nullopt;
+                if(last == 0 or size == 0) continue;
+                ranges.push_back({ size - std::min(last, size), size - 1 });
+                continue;
+            }
+
+            if(not number(spec.substr(0, dash), first)) return std::nullopt;
+            if(dash + 1 == spec.size()) {
+                last = size - 1;
+            }
+            else {
+                if(not number(spec.substr(dash + 1), last) or last < first) return std::nullopt;
+                last = std::min(last, size - 1);
+            }
+
+            if(first >= size) continue;
+            ranges.push_back({ first, last });
+        }
+
+        if(specs == 0) return std::nullopt;
+        return ranges;
+    }
+
+    /**
+     * Formats time as IMF-fixdate, as used in Last-Modified.
+     */
+    inline std::string http_date(time_t t) {
+        static constexpr const char* days[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+        static constexpr const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                                  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+        tm g{};
+        gmtime_r(&t, &g);
+
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                 days[g.tm_wday], g.tm_mday, months[g.tm_mon], g.tm_year + 1900, g.tm_hour, g.tm_min, g.tm_sec);
+        return buf;
+    }
+
+    /**
+     * Parses IMF-fixdate, returns -1 on failure.
+     */
+    inline time_t parse_http_date(const char* s) {
+        if(not s) return -1;
+
+        tm g{};
+        auto const* end = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &g);
+        if(not end or *end != '\0') return -1;
+        return timegm(&g);
+    }
+
 /**
  * Base controller for handling http requests.
  */
 
+    /**
+     * Response body made of segments, sent with MHD_create_response_from_iovec.
+     * Persistent segments are only referenced and must outlive the response (static templates,
+     * envelopes shared by all requests). Owned segments are kept alive by the body and
+     * by every response created from it.
+     */
+    struct ResponseBody {
+        using owned_t = std::deque<std::string>; // deque doesn't relocate elements on push_back
+
+        explicit ResponseBody(std::pmr::memory_resource* mr = std::pmr::get_default_resource()) : segments(mr) {}
+
+        void add_persistent(std::string_view data) {
+            if(not data.empty()) segments.emplace_back(data);
+        }
+
+        void add_owned(std::string data) {
+            if(data.empty()) return;
+
+            if(not owned) owned = std::make_shared<owned_t>();
+            owned->emplace_back(std::move(data));
+            segments.emplace_back(owned->back());
+        }
+
+        size_t size() const {
+            size_t sz = 0;
+            for(auto const& s: segments) sz += s.size();
+            return sz;
+        }
+
+        bool empty() const { return segments.empty(); }
+
+        void clear() {
+            segments.clear();
+            owned.reset();
+        }
+
+        MHD_Response* create_response() const {
+#if MHD_VERSION >= 0x00097400
+            std::pmr::vector<MHD_IoVec> iov(segments.get_allocator().resource());
+            iov.reserve(segments.size());
+            for(auto const& s: segments) {
+                iov.push_back({ s.data(), s.size() });
+            }
+
+            // response holds its own reference to owned segments, it may outlive connection state
+            auto* keep = owned ? new std::shared_ptr<owned_t>(owned) : nullptr;
+            auto* response = MHD_create_response_from_iovec(iov.data(), static_cast<unsigned int>(iov.size()),
+                                                            keep ? &release_owned : nullptr, keep);
+            if(not response) delete keep;
+            return response;
+#else
+            // no iovec support in this libmicrohttpd, fall back to single copy
+            std::string data;
+            data.reserve(size());
+            for(auto const& s: segments) data.append(s);
+            return MHD_create_response_from_buffer(data.size(), (void*) data.data(), MHD_RESPMEM_MUST_COPY);
+#endif
+        }
+
+        std::pmr::vector<std::string_view> segments;
+        std::shared_ptr<owned_t> owned;    // not in arena, responses may outlive the request
+
+    private:
+        static void release_owned(void* cls) {
+            delete static_cast<std::shared_ptr<owned_t>*>(cls);
+        }
+    };
+
+    /**
+     * Request method, values are bits usable in MethodSet.
+     */
+    enum class Method : uint16_t {
+        UNKNOWN = 0,
+        GET = 1 << 0,
+        HEAD = 1 << 1,
+        POST = 1 << 2,
+        PUT = 1 << 3,
+        DELETE = 1 << 4,
+        PATCH = 1 << 5,
+        OPTIONS = 1 << 6,
+        CONNECT = 1 << 7,
+        TRACE = 1 << 8,
+        OTHER = 1 << 15,     // not known method, routed by name through validPath()
+    };
+
+    class MethodSet {
+    public:
+        constexpr MethodSet() = default;
+        constexpr MethodSet(Method m) : bits_(static_cast<uint16_t>(m)) {}
+
+        static constexpr MethodSet all() { MethodSet s; s.bits_ = 0xffff; return s; }
+
+        constexpr bool contains(Method m) const { return (bits_ & static_cast<uint16_t>(m)) != 0; }
+        constexpr MethodSet operator|(MethodSet other) const { MethodSet s; s.bits_ = bits_ | other.bits_; return s; }
+
+    private:
+        uint16_t bits_ = 0;
+    };
+
+    constexpr MethodSet operator|(Method a, Method b) { return MethodSet(a) | b; }
+
+    namespace detail {
+        inline constexpr std::pair<const char*, Method> methods[] = {
+                { MHD_HTTP_METHOD_GET, Method::GET },
+                { MHD_HTTP_METHOD_POST, Method::POST },
+                { MHD_HTTP_METHOD_HEAD, Method::HEAD },
+                { MHD_HTTP_METHOD_PUT, Method::PUT },
+                { MHD_HTTP_METHOD_DELETE, Method::DELETE },
+                { MHD_HTTP_METHOD_PATCH, Method::PATCH },
+                { MHD_HTTP_METHOD_OPTIONS, Method::OPTIONS },
+                { MHD_HTTP_METHOD_CONNECT, Method::CONNECT },
+                { MHD_HTTP_METHOD_TRACE, Method::TRACE },
+        };
+    }
+
+    /**
+     * Parse method string to Method. Cheap pointer comparison with MHD_HTTP_METHOD_* goes first,
+     * string comparison is the fallback.
+     */
+    inline Method parse_method(const char* method) {
+        if(not method) return Method::UNKNOWN;
+
+        for(auto const& [name, m]: detail::methods) {
+            if(method == name) return m;
+        }
+        for(auto const& [name, m]: detail::methods) {
+            if(strcmp(method, name) == 0) return m;
+        }
+        return Method::OTHER;
+    }
+
+    inline const char* method_name(Method method) {
+        for(auto const& [name, m]: detail::methods) {
+            if(m == method) return name;
+        }
+        return "";
+    }
+
+    /**
+     * Upstream of request arenas. Blocks released by finished requests are pooled and reused
+     * by next ones instead of going back to malloc. It's thread safe with per-thread pools,
+     * so a request can allocate also from worker threads.
+     */
+    inline std::pmr::memory_resource* request_arena_upstream() {
+        static std::pmr::synchronized_pool_resource pool;
+        return &pool;
+    }
+
     class Controller;
     struct ConnectionState {
         explicit ConnectionState(Controller& controller) : conroller(controller) {}
+        virtual ~ConnectionState() = default;
+
+        ConnectionState(ConnectionState const&) = delete;
+        ConnectionState& operator=(ConnectionState const&) = delete;
+
+        // states themselves are pooled too
+        static void* operator new(size_t sz) { return request_arena_upstream()->allocate(sz); }
+        static void operator delete(void* p, size_t sz) { request_arena_upstream()->deallocate(p, sz); }
+
         Controller& conroller;
-        std::string request_data;
 
+        /**
+         * Bump-pointer arena for all per-request memory, released with the state in handleComplete.
+         * Controllers can allocate from it with allocator<T>() and std::pmr containers.
+         */
+        std::pmr::memory_resource* arena() { return &arena_; }
+
+        template<typename T = std::byte>
+        std::pmr::polymorphic_allocator<T> allocator() { return std::pmr::polymorphic_allocator<T>(&arena_); }
+
+    private:
+        // arena must be constructed before members allocating from it
+        std::array<std::byte, 2048> arena_buffer_;
+        std::pmr::monotonic_buffer_resource arena_ { arena_buffer_.data(), arena_buffer_.size(), request_arena_upstream() };
+
+    public:
+        std::pmr::string request_data { &arena_ };
+
+        bool response_created = false;
         bool response_sent = false;
-        std::vector<std::pair<std::string,std::string>> response_headers;
-        std::string response_data;
+        std::pmr::vector<std::pair<std::pmr::string, std::pmr::string>> response_headers { &arena_ };
+        std::pmr::string response_data { &arena_ };
+        ResponseBody response_body { &arena_ };
 
+        Method method = Method::UNKNOWN;
         uint32_t request_waiting_loop_counter = 0;
+
+        // DynamicController offloading and coalescing
+        std::atomic<bool> offloaded { false };
+        bool offload_failed = false;
+        std::shared_ptr<struct Flight> flight;
+        bool flight_tried = false;
+
+        /**
+         * Prepares state for the next request on the same keep-alive connection.
+         * Derived states are not recycled unless they override it (calling clear() and resetting their own data).
+         */
+        virtual bool reset() {
+            if(typeid(*this) != typeid(ConnectionState)) return false;
+
+            clear();
+            return true;
+        }
+
+    protected:
+        void clear() {
+            // containers must let go of arena memory before it's released
+            request_data = std::pmr::string(&arena_);
+            response_headers = decltype(response_headers)(&arena_);
+            response_data = std::pmr::string(&arena_);
+            response_body = ResponseBody(&arena_);
+            arena_.release();
+
+            response_created = false;
+            response_sent = false;
+            method = Method::UNKNOWN;
+            request_waiting_loop_counter = 0;
+
+            offloaded = false;
+            offload_failed = false;
+            flight.reset();
+            flight_tried = false;
+        }
+    };
+
+    /**
+     * Authenticated client, as established by Authenticator of the route.
+     */
+    struct Identity {
+        std::string scheme;                                         // "bearer", "basic", ...
+        std::string subject;
+        std::vector<std::pair<std::string, std::string>> claims;    // scheme specific attributes
+
+        std::string_view claim(std::string_view name) const {
+            for(auto const& [k, v]: claims)
+                if(k == name) return v;
+            return {};
+        }
+    };
+
+    class Bulkhead;
+
+    /**
+     * Per TCP connection data, lives in libmicrohttpd socket context for the whole keep-alive connection.
+     */
+    struct ConnectionContext {
+        std::unique_ptr<ConnectionState> spare;       // state of finished request, reused by the next one
+        std::optional<bool> ip_allowed;
+        unsigned int timeout = 0;                     // last timeout set on connection by controller
+        uint64_t requests = 0;
+        bool in_flight = false;                       // current request is counted in WebServer::in_flight()
+        std::shared_ptr<Identity const> identity;     // of the current request
+        bool stale_nonce = false;                     // digest nonce of current request refused, fail response signals stale
+
+        // client certificate identity, parsed once per TLS session (null if there is no valid certificate)
+        std::optional<std::shared_ptr<Identity const>> tls_identity;
+
+        // bulkhead current request holds a slot in (or waits in, if queued), and controller it's for
+        std::shared_ptr<Bulkhead> bulkhead;
+        Controller* bulkhead_controller = nullptr;
+        bool bulkhead_queued = false;
+        bool bulkhead_refused = false;                // taken out of the queue on shutdown, answered 503
+
+        // suspended connections of the server owning connection, see suspend_connection()
+        std::atomic<size_t>* suspended = nullptr;
+
+        static ConnectionContext* of(struct MHD_Connection* connection) {
+            auto const* ci = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_SOCKET_CONTEXT);
+            return ci ? static_cast<ConnectionContext*>(ci->socket_context) : nullptr;
+        }
+    };
+
+    /**
+     * MHD_suspend_connection() counted by the server, so it knows when it's safe to stop daemon.
+     */
+    inline void suspend_connection(struct MHD_Connection* connection) {
+        if(auto const* ctx = ConnectionContext::of(connection); ctx and ctx->suspended) ++*ctx->suspended;
+        MHD_suspend_connection(connection);
+    }
+
+    /**
+     * MHD_resume_connection() of connection suspended by suspend_connection().
+     */
+    inline void resume_connection(struct MHD_Connection* connection) {
+        // resumed connection may be closed (and its context gone) by the time resume returns
+        auto const* ctx = ConnectionContext::of(connection);
+        auto* suspended = ctx ? ctx->suspended : nullptr;
+
+        MHD_resume_connection(connection);
+        if(suspended) --*suspended;
+    }
+
+    /**
+     * Request carried inside another one (batch sub-request): its own identity and query arguments.
+     */
+    struct RequestPart {
+        std::shared_ptr<Identity const> identity;
+        std::vector<std::pair<std::string, std::string>> arguments;
+    };
+
+    namespace detail {
+        // request part whose handler runs on this thread, see PartScope
+        inline thread_local RequestPart const* part = nullptr;
+    }
+
+    /**
+     * Identity of request being handled, null for routes without authenticator.
+     */
+    inline Identity const* request_identity(struct MHD_Connection* connection) {
+        if(detail::part) return detail::part->identity.get();
+
+        auto const* ctx = ConnectionContext::of(connection);
+        return ctx ? ctx->identity.get() : nullptr;
+    }
+
+    /**
+     * Query argument of request being handled, null if there is none. Unlike MHD_lookup_connection_value()
+     * it sees arguments of request part.
+     */
+    inline const char* request_argument(struct MHD_Connection* connection, const char* name) {
+        if(detail::part) {
+            for(auto const& [k, v]: detail::part->arguments)
+                if(k == name) return v.c_str();
+            return nullptr;
+        }
+        return MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, name);
+    }
+
+/**
+ * While alive, request_identity() and request_argument() on this thread return those of request part instead
+ * of request on the connection. Parts of one request run in parallel, so connection can't hold them.
+ */
+    class PartScope {
+    public:
+        explicit PartScope(RequestPart const& part) : previous_(detail::part) {
+            detail::part = &part;
+        }
+        ~PartScope() { detail::part = previous_; }
+
+        PartScope(PartScope const&) = delete;
+        PartScope& operator=(PartScope const&) = delete;
+
+    private:
+        RequestPart const* previous_;
+    };
+
+/**
+ * Authentication of requests, run by WebServer before the request reaches controller.
+ */
+    class Authenticator {
+    public:
+        virtual ~Authenticator() = default;
+
+        /**
+         * Identity of the client, null if credentials are missing or not valid.
+         */
+        virtual std::shared_ptr<Identity const> authenticate(struct MHD_Connection* connection) = 0;
+
+        /**
+         * Status of rejected request, also used for batch parts which can't carry reject() response.
+         */
+        virtual unsigned int reject_status() const { return MHD_HTTP_UNAUTHORIZED; }
+
+        /**
+         * Respond to request which didn't authenticate. Default is bare reject_status().
+         */
+        virtual int reject(struct MHD_Connection* connection) {
+            auto* response = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+            auto ret = MHD_queue_response(connection, reject_status(), response);
+            MHD_destroy_response(response);
+            return ret;
+        }
+    };
+
+/**
+ * Pins threads to cpus from the list in turn. Memory is placed on the node of cpu which touches it first,
+ * so what a thread allocates after it is pinned (arena pools, buffers) stays node-local. Workers pin
+ * at thread start; daemon threads only on their first connection, after libmicrohttpd allocated
+ * thread state and that connection's memory pool, which may stay on another node.
+ */
+    class CpuAffinity {
+    public:
+        explicit CpuAffinity(std::vector<int> cpus) : cpus_(std::move(cpus)) {}
+
+        CpuAffinity(CpuAffinity const&) = delete;
+        CpuAffinity& operator=(CpuAffinity const&) = delete;
+
+        /**
+         * Pins calling thread to next cpu, returns the cpu or -1.
+         */
+        int pin_next() {
+            if(cpus_.empty()) return -1;
+
+            auto const cpu = cpus_[next_.fetch_add(1, std::memory_order_relaxed) % cpus_.size()];
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? cpu : -1;
+        }
+
+        /**
+         * Pins calling thread on its first call, used from callbacks of threads we don't create.
+         */
+        void pin_once() {
+            thread_local CpuAffinity const* pinned = nullptr;
+            if(pinned == this) return;
+
+            pinned = this;
+            pin_next();
+        }
+
+        std::vector<int> const& cpus() const { return cpus_; }
+
+        /**
+         * Cpus of NUMA node, read from sysfs ("0-3,8-11"). Empty if node doesn't exist.
+         */
+        static std::vector<int> node_cpus(int node) {
+            std::vector<int> cpus;
+            std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string range;
+            while(std::getline(f, range, ',')) {
+                int first = 0;
+                int last = 0;
+                auto const n = sscanf(range.c_str(), "%d-%d", &first, &last);
+                if(n < 1) continue;
+                if(n == 1) last = first;
+                for(int c = first; c <= last; ++c) cpus.push_back(c);
+            }
+            return cpus;
+        }
+
+    private:
+        std::vector<int> cpus_;
+        std::atomic<size_t> next_ = 0;
+    };
+
+    /**
+     * Scheduling class of work in WorkerPool, set per route with Controller::priority().
+     */
+    enum class Priority : unsigned { CRITICAL = 0, NORMAL, BULK };
+    constexpr size_t priority_count = 3;
+
+/**
+ * Fixed pool of threads for work taken off libmicrohttpd thread.
+ * Each priority has its own queue, queues are served by smooth weighted round robin so lower classes
+ * get their share but never hold up critical work for long. Reserved threads take only CRITICAL work,
+ * so health checks and control calls have capacity even when bulk work occupies all the others.
+ */
+    class WorkerPool {
+    public:
+        struct options_t {
+            std::array<unsigned int, priority_count> weights = { 8, 4, 1 };
+            size_t reserved = 0;                  // threads out of the pool kept for CRITICAL work
+        };
+
+        explicit WorkerPool(size_t threads, std::shared_ptr<CpuAffinity> affinity = nullptr)
+            : WorkerPool(threads, options_t(), std::move(affinity)) {}
+
+        WorkerPool(size_t threads, options_t o, std::shared_ptr<CpuAffinity> affinity = nullptr) : options_(o) {
+            threads = std::max<size_t>(threads, 1);
+            // at least one thread takes everything
+            options_.reserved = std::min(options_.reserved, threads - 1);
+
+            for(size_t i = 0; i < threads; ++i) {
+                threads_.emplace_back([this, affinity, critical_only = i < options_.reserved]() {
+                    if(affinity) affinity->pin_next();
+                    run(critical_only);
+                });
+            }
+        }
+
+        WorkerPool(WorkerPool const&) = delete;
+        WorkerPool& operator=(WorkerPool const&) = delete;
+
+        ~WorkerPool() {
+            {
+                auto l_ = std::lock_guard(lock_);
+                stop_ = true;
+            }
+            cv_.notify_all();
+            cv_critical_.notify_all();
+            for(auto& t: threads_) t.join();
+        }
+
+        void submit(std::function<void()> task, Priority priority = Priority::NORMAL) {
+            {
+                auto l_ = std::lock_guard(lock_);
+                queues_[index(priority)].emplace_back(std::move(task));
+            }
+            cv_.notify_one();
+            if(priority == Priority::CRITICAL and options_.reserved)
+                cv_critical_.notify_one();
+        }
+
+        size_t size() const { return threads_.size(); }
+        options_t const& options() const { return options_; }
+
+        /**
+         * Tasks waiting in queue of priority.
+         */
+        size_t queued(Priority priority) const {
+            auto l_ = std::lock_guard(lock_);
+            return queues_[index(priority)].size();
+        }
+
+        /**
+         * Waits until all queued tasks are done and no worker runs any, or deadline passes. Returns true if idle.
+         */
+        bool wait_idle(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) const {
+            auto l_ = std::unique_lock(lock_);
+            auto const idle = [this]() { return running_ == 0 and empty(); };
+            if(deadline == std::chrono::steady_clock::time_point::max()) {
+                cv_idle_.wait(l_, idle);
+                return true;
+            }
+            return cv_idle_.wait_until(l_, deadline, idle);
+        }
+
+    private:
+        static size_t index(Priority p) { return static_cast<size_t>(p); }
+
+        bool empty() const {
+            return std::all_of(queues_.begin(), queues_.end(), [](auto const& q) { return q.empty(); });
+        }
+
+        // smooth weighted round robin over non-empty queues, called with lock held and some queue non-empty
+        size_t pick() {
+            long total = 0;
+            size_t best = priority_count;
+            for(size_t i = 0; i < priority_count; ++i) {
+                if(queues_[i].empty()) continue;
+
+                current_[i] += options_.weights[i];
+                total += options_.weights[i];
+                if(best == priority_count or current_[i] > current_[best]) best = i;
+            }
+            current_[best] -= total;
+            return best;
+        }
+
+        void run(bool critical_only) {
+            auto& critical = queues_[index(Priority::CRITICAL)];
+            auto& cv = critical_only ? cv_critical_ : cv_;
+
+            while(true) {
+                std::function<void()> task;
+                {
+                    auto l_ = std::unique_lock(lock_);
+                    cv.wait(l_, [&]() { return stop_ or not (critical_only ? critical.empty() : empty()); });
+
+                    // queued work is finished before stopping
+                    if(critical_only ? critical.empty() : empty()) return;
+
+                    auto& q = critical_only ? critical : queues_[pick()];
+                    task = std::move(q.front());
+                    q.pop_front();
+                    ++running_;
+                }
+                task();
+
+                auto l_ = std::lock_guard(lock_);
+                if(--running_ == 0 and empty()) cv_idle_.notify_all();
+            }
+        }
+
+        options_t options_;
+
+        mutable std::mutex lock_;
+        std::condition_variable cv_;
+        std::condition_variable cv_critical_;
+        mutable std::condition_variable cv_idle_;
+        std::array<std::deque<std::function<void()>>, priority_count> queues_;
+        std::array<long, priority_count> current_ {};
+        size_t running_ = 0;
+        bool stop_ = false;
+        std::vector<std::thread> threads_;
+    };
+
+    /**
+     * Response computed once and shared by all coalesced requests.
+     */
+    struct Flight {
+        explicit Flight(std::string k) : key(std::move(k)) {}
+        Flight(Flight const&) = delete;
+        Flight& operator=(Flight const&) = delete;
+        ~Flight() { if(response) MHD_destroy_response(response); }
+
+        std::string key;
+        MHD_Response* response = nullptr;          // null if leader failed
+        unsigned int status = MHD_HTTP_OK;
+        std::vector<struct MHD_Connection*> followers;
+    };
+
+    /**
+     * Single-flight groups: concurrent requests with the same key are suspended while the first one (leader)
+     * computes response, then they are resumed and get the same refcounted MHD_Response.
+     */
+    class Coalescer {
+    public:
+        /**
+         * Returns true if connection became follower and was suspended, false if it's the leader.
+         */
+        bool join(std::string const& key, struct MHD_Connection* connection, std::shared_ptr<Flight>& flight) {
+            auto l_ = std::lock_guard(lock_);
+
+            auto it = flights_.find(key);
+            if(it != flights_.end()) {
+                flight = it->second;
+                flight->followers.push_back(connection);
+                suspend_connection(connection);
+                return true;
+            }
+
+            flight = std::make_shared<Flight>(key);
+            flights_.emplace(key, flight);
+            return false;
+        }
+
+        /**
+         * Leader is done, response (takes ownership, may be null) is handed to followers which are resumed.
+         */
+        void finish(std::shared_ptr<Flight> const& flight, MHD_Response* response, unsigned int status) {
+            auto l_ = std::lock_guard(lock_);
+
+            flight->response = response;
+            flight->status = status;
+            flights_.erase(flight->key);
+
+            for(auto* c: flight->followers) resume_connection(c);
+            flight->followers.clear();
+        }
+
+        /**
+         * Follower connection is going away before the leader finished.
+         */
+        void leave(std::shared_ptr<Flight> const& flight, struct MHD_Connection* connection) {
+            auto l_ = std::lock_guard(lock_);
+            auto& f = flight->followers;
+            f.erase(std::remove(f.begin(), f.end(), connection), f.end());
+        }
+
+        size_t size() const {
+            auto l_ = std::lock_guard(lock_);
+            return flights_.size();
+        }
+
+    private:
+        mutable std::mutex lock_;
+        std::unordered_map<std::string, std::shared_ptr<Flight>> flights_;
+    };
+
+/**
+ * Concurrency limit of a controller, so one slow route can't take all connections and workers.
+ * Requests over max_in_flight wait suspended in FIFO of max_queued, the rest is rejected with 503.
+ * Slot is held from dispatch until request completes and is handed directly to the oldest waiting request.
+ */
+    class Bulkhead {
+    public:
+        struct options_t {
+            size_t max_in_flight = 64;
+            size_t max_queued = 0;                // needs suspend/resume, enabled by WebServer when non-zero
+        };
+
+        struct stats_t {
+            std::atomic<uint64_t> admitted = 0;
+            std::atomic<uint64_t> queued = 0;     // admitted after waiting
+            std::atomic<uint64_t> rejected = 0;
+        };
+
+        enum class admit_t { ADMITTED, QUEUED, REJECTED };
+
+        Bulkhead() : Bulkhead(options_t()) {}
+        explicit Bulkhead(options_t o) : options_(o) {}
+
+        Bulkhead(Bulkhead const&) = delete;
+        Bulkhead& operator=(Bulkhead const&) = delete;
+
+        options_t const& options() const { return options_; }
+        stats_t const& stats() const { return stats_; }
+
+        /**
+         * Takes slot for request, or suspends connection in the queue. Suspending under the lock
+         * makes sure release() can't resume it before it's suspended.
+         */
+        admit_t admit(struct MHD_Connection* connection) {
+            auto l_ = std::lock_guard(lock_);
+
+            if(in_flight_ < options_.max_in_flight) {
+                ++in_flight_;
+                ++stats_.admitted;
+                return admit_t::ADMITTED;
+            }
+            if(waiting_.size() < options_.max_queued) {
+                waiting_.push_back(connection);
+                suspend_connection(connection);
+                ++stats_.queued;
+                return admit_t::QUEUED;
+            }
+            ++stats_.rejected;
+            return admit_t::REJECTED;
+        }
+
+        /**
+         * Takes slot if one is free, never queues. For request parts, which can't be suspended on their own.
+         */
+        bool try_acquire() {
+            auto l_ = std::lock_guard(lock_);
+
+            if(in_flight_ < options_.max_in_flight) {
+                ++in_flight_;
+                ++stats_.admitted;
+                return true;
+            }
+            ++stats_.rejected;
+            return false;
+        }
+
+        /**
+         * Returns slot of completed request. If some request waits, slot is passed to it and its connection
+         * is returned - caller marks it admitted and resumes it.
+         */
+        struct MHD_Connection* release() {
+            auto l_ = std::lock_guard(lock_);
+
+            if(waiting_.empty()) {
+                --in_flight_;
+                return nullptr;
+            }
+            auto* next = waiting_.front();
+            waiting_.pop_front();
+            ++stats_.admitted;
+            return next;
+        }
+
+        /**
+         * Takes all waiting requests out of the queue, caller turns them away and resumes them.
+         */
+        std::deque<struct MHD_Connection*> take_waiting() {
+            auto l_ = std::lock_guard(lock_);
+
+            stats_.rejected += waiting_.size();
+            return std::exchange(waiting_, {});
+        }
+
+        /**
+         * Drops waiting request which ended without being resumed.
+         */
+        void cancel(struct MHD_Connection* connection) {
+            auto l_ = std::lock_guard(lock_);
+            waiting_.erase(std::remove(waiting_.begin(), waiting_.end(), connection), waiting_.end());
+        }
+
+        size_t in_flight() const {
+            auto l_ = std::lock_guard(lock_);
+            return in_flight_;
+        }
+
+        size_t waiting() const {
+            auto l_ = std::lock_guard(lock_);
+            return waiting_.size();
+        }
+
+    private:
+        options_t options_;
+        stats_t stats_;
+
+        mutable std::mutex lock_;
+        size_t in_flight_ = 0;
+        std::deque<struct MHD_Connection*> waiting_;
     };
 
     class Controller{
 
     public:
         virtual ~Controller() = default;
+
+        /**
+         * Methods handled by this controller, router skips it for other methods without asking.
+         */
+        virtual MethodSet methods() const { return MethodSet::all(); }
+
+        /**
+         * Requests are let in only if authenticator accepts them, identity is in request_identity().
+         * Responses may then differ per client: request_key() and CachedController keys include the identity,
+         * custom coalesceKey() or cacheKey() must include it too (or not share responses at all).
+         */
+        void authenticator(std::shared_ptr<Authenticator> a) { authenticator_ = std::move(a); }
+        std::shared_ptr<Authenticator> const& authenticator() const { return authenticator_; }
+
+        /**
+         * Limit of concurrent requests for this controller, enforced by WebServer on dispatch.
+         */
+        void bulkhead(std::shared_ptr<Bulkhead> b) { bulkhead_ = std::move(b); }
+        std::shared_ptr<Bulkhead> const& bulkhead() const { return bulkhead_; }
+
+        /**
+         * True if controller suspends connections itself, daemon is then started with suspend/resume allowed.
+         */
+        virtual bool suspends() const { return false; }
+
+        /**
+         * Priority of work this controller offloads to WorkerPool.
+         */
+        void priority(Priority p) { priority_ = p; }
+        Priority priority() const { return priority_; }
+
         /**
          * Check if given path and method are handled by this controller.
+         * Default is to ask string based validPath().
+         */
+        virtual bool validRoute(const char* path, Method method) { return validPath(path, method_name(method)); }
+
+        /**
+         * Check if given path and method are handled by this controller. Prefer validRoute(),
+         * this one is called only for methods not known to Method (Method::OTHER).
          */
-        virtual bool validPath(const char* path, const char* method) = 0;
+        virtual bool validPath(const char* path, const char* method) { return false; }
+
+        /**
+         * Connection idle timeout (seconds) applied when this controller takes a request, 0 keeps daemon default.
+         * Lets route classes differ, ie. short for API calls, long for downloads.
+         */
+        virtual unsigned int connection_timeout() const { return 0; }
 
         /**
          * Handles given request.
@@ -82,10 +1102,48 @@ namespace lmh {
                                   const char* url, const char* method, const char* upload_data,
                                   size_t* upload_data_size, void** ptr) = 0;
         virtual int handleComplete(struct MHD_Connection* connection, enum MHD_RequestTerminationCode toe, ConnectionState* cs) {
-            if(cs) delete cs;
+            if(cs and not recycle_state(connection, toe, cs))
+                delete cs;
             return MHD_YES;
         }
         virtual ConnectionState* create_state() { return new ConnectionState(*this); };
+
+        /**
+         * Called by WebServer::stop_daemon() once running daemon is stopped and no request is running.
+         * Not called when start_daemon() replaces dead daemon.
+         */
+        virtual void onStop() {}
+
+        /**
+         * State for new request: the one recycled by previous request on the same keep-alive connection,
+         * or a new one from create_state().
+         */
+        ConnectionState* acquire_state(struct MHD_Connection* connection) {
+            auto* ctx = ConnectionContext::of(connection);
+            if(ctx and ctx->spare and &ctx->spare->conroller == this) {
+                return ctx->spare.release();
+            }
+            return create_state();
+        }
+
+    protected:
+        /**
+         * Keeps finished state in connection context for the next pipelined/keep-alive request.
+         */
+        static bool recycle_state(struct MHD_Connection* connection, enum MHD_RequestTerminationCode toe, ConnectionState* cs) {
+            if(toe != MHD_REQUEST_TERMINATED_COMPLETED_OK) return false;
+
+            auto* ctx = ConnectionContext::of(connection);
+            if(not ctx or ctx->spare or not cs->reset()) return false;
+
+            ctx->spare.reset(cs);
+            return true;
+        }
+
+    private:
+        std::shared_ptr<Authenticator> authenticator_;
+        std::shared_ptr<Bulkhead> bulkhead_;
+        Priority priority_ = Priority::NORMAL;
     };
 
 
@@ -105,81 +1163,292 @@ namespace lmh {
         static inline timespec waiting_usec_sleep = { 0, 10000000 }; // 10 ms
         static inline uint32_t waiting_loops = 300; // this is ~ 3s
 
-        bool validPath(const char* path, const char* method) override = 0;
+        /**
+         * True if createResponse() can run on worker threads, in parallel with other requests.
+         */
+        virtual bool concurrent() const { return false; }
+
+        /**
+         * User defined http response.
+         */
+        virtual ResponseParams createResponse(struct MHD_Connection* connection,
+                                    const char* url, const char* method, const char* upload_data,
+                                    size_t* upload_data_size, void** ptr, std::stringstream& response) = 0;
+
+        /**
+         * Run createResponse() on worker pool, connection is suspended meanwhile. Only for concurrent() controllers,
+         * daemon is started with suspend/resume allowed for them.
+         */
+        void offload(std::shared_ptr<WorkerPool> pool) { workers_ = std::move(pool); }
+
+        bool suspends() const override { return workers_ and concurrent(); }
+
+        /**
+         * Key for coalescing identical concurrent requests: requests with the same key wait for the first one
+         * and get its response. Default is not to coalesce, request_key() is a good key for GETs.
+         * Applies to offloaded requests without body only.
+         */
+        virtual std::optional<std::string> coalesceKey(struct MHD_Connection* connection, const char* url, Method method) {
+            return std::nullopt;
+        }
+
+        /**
+         * Method, url and query arguments of the request, and identity of authenticated client.
+         */
+        static std::string request_key(struct MHD_Connection* connection, const char* url, Method method) {
+            std::string key = method_name(method);
+            key.append(" ").append(url);
+
+            MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND,
+                                      [](void* cls, enum MHD_ValueKind, const char* k, const char* v) -> decltype(MHD_YES) {
+                                          auto& key = *static_cast<std::string*>(cls);
+                                          key.append(key.find('?') == std::string::npos ? "?" : "&").append(k);
+                                          if(v) key.append("=").append(v);
+                                          return MHD_YES;
+                                      }, &key);
+
+            // newline can't be in url, identity can't be forged by query
+            if(auto const* identity = request_identity(connection); identity)
+                key.append("\n").append(identity->scheme).append(":").append(identity->subject);
+            return key;
+        }
+
+        int handleRequest(struct MHD_Connection* connection,
+                                  const char* url, const char* method, const char* upload_data,
+                                  size_t* upload_data_size, void** ptr) override {
+
+            // state is destroyed in specific handler
+            if(not *ptr) {
+                auto* created = acquire_state(connection);
+                created->method = parse_method(method);
+                *ptr = created;
+            }
+
+            auto* state = reinterpret_cast<lmh::ConnectionState*>(*ptr);
+
+            // default return is - continue with connection
+            int ret = MHD_YES;
+            if(not state->response_sent) {
+
+                if(state->offload_failed) return MHD_NO;
+
+                // response not sent, because we did not receive any POST data yet.
+                // ptr is now set, we can return and wait for data to arrive.
+                if(state->method == Method::POST and upload_data == nullptr and not state->response_created and not state->flight) {
+
+                    // request timeout - empty request
+                    if(++state->request_waiting_loop_counter > DynamicController::waiting_loops)
+                        return MHD_NO;
+
+                    timespec remaining;
+                    nanosleep(&DynamicController::waiting_usec_sleep, &remaining);
+
+                    // we don't care if we won't succeed with sleep, we will get here multiple times
+                    // so few cycles more doesn't matter.
+
+                    return MHD_YES;
+                }
+
+                // it response is not created yet, call createResponse & co
+                if(not state->response_created and not state->flight) {
+
+                    if(workers_ and concurrent()) {
+                        if(not state->flight_tried and upload_data == nullptr) {
+                            state->flight_tried = true;
+                            if(auto key = coalesceKey(connection, url, state->method); key) {
+                                // follower is resumed when leader finishes
+                                if(coalescer_.join(*key, connection, state->flight))
+                                    return MHD_YES;
+                            }
+                        }
+
+                        start_offloaded(connection, url, method, upload_data, upload_data_size, state);
+                        return MHD_YES;
+                    }
+
+                    if(not create(connection, url, method, upload_data, upload_data_size, ptr, *state))
+                        return MHD_NO;
+                }
+
+                MHD_Response* response = nullptr;
+                unsigned int status = MHD_HTTP_OK;
+
+                // no shared response: follower computes its own, leader builds it again
+                if(state->flight and not state->flight->response) {
+                    state->flight.reset();
+                    if(not state->response_created)
+                        return handleRequest(connection, url, method, upload_data, upload_data_size, ptr);
+                }
+
+                if(state->flight) {
+                    // shared response, queue adds its own reference
+                    response = state->flight->response;
+                    status = state->flight->status;
+                    ret = MHD_queue_response(connection, status, response);
+                }
+                else {
+                    response = makeResponse(*state);
+                    if(not response) return MHD_NO;
+
+                    ret = MHD_queue_response(connection, status, response);
+                    MHD_destroy_response(response);
+                }
+
+                if (ret == MHD_YES) {
+                    state->response_sent = true;
+                }
+            }
+
+            // except handlers won't say otherwise, we continue with connection
+            return MHD_YES;
+        }
+
+        int handleComplete(struct MHD_Connection* connection, enum MHD_RequestTerminationCode toe, ConnectionState* cs) override {
+            if(cs) {
+                // worker may still use connection (client abort, shutdown), wait for it
+                {
+                    auto l_ = std::unique_lock(offload_lock_);
+                    offload_done_.wait(l_, [cs]() { return not cs->offloaded; });
+                }
+                if(cs->flight) coalescer_.leave(cs->flight, connection);
+            }
+            return Controller::handleComplete(connection, toe, cs);
+        }
+
+        Coalescer const& coalescer() const { return coalescer_; }
 
+    protected:
         /**
-         * User defined http response.
+         * Parsed method of request being handled, for use in createResponse().
          */
-        virtual ResponseParams createResponse(struct MHD_Connection* connection,
-                                    const char* url, const char* method, const char* upload_data,
-                                    size_t* upload_data_size, void** ptr, std::stringstream& response) = 0;
+        static Method request_method(void** ptr) {
+            return *ptr ? reinterpret_cast<lmh::ConnectionState*>(*ptr)->method : Method::UNKNOWN;
+        }
 
-        int handleRequest(struct MHD_Connection* connection,
-                                  const char* url, const char* method, const char* upload_data,
-                                  size_t* upload_data_size, void** ptr) override {
+        /**
+         * Creates MHD response from already created state data.
+         */
+        virtual MHD_Response* buildResponse(ConnectionState& state) {
+            return MHD_create_response_from_buffer(
+                    state.response_data.size(),
+                    (void *) state.response_data.c_str(), MHD_RESPMEM_MUST_COPY);
+        }
 
-            // state is destroyed in specific handler
-            if(not *ptr) *ptr = create_state();
+        /**
+         * Response with headers, from already created state data.
+         */
+        MHD_Response* makeResponse(ConnectionState& state) {
+            auto *response = buildResponse(state);
+            if(not response) return nullptr;
 
-            auto* state = reinterpret_cast<lmh::ConnectionState*>(*ptr);
+            for(auto const& [hdr, hdr_val]: state.response_headers ) {
+                MHD_add_response_header(response, hdr.c_str(), hdr_val.c_str());
+            }
+            return response;
+        }
 
-            // default return is - continue with connection
-            int ret = MHD_YES;
-            if(not state->response_sent) {
+        /**
+         * Calls createResponse() and stores its result in state, false if handler refused the request.
+         */
+        bool create(struct MHD_Connection* connection, const char* url, const char* method, const char* upload_data,
+                    size_t* upload_data_size, void** ptr, ConnectionState& state) {
 
+            // stream is reused by all requests on this thread, it keeps its buffer
+            thread_local std::stringstream response_ss;
+            response_ss.str({});
+            response_ss.clear();
 
-                std::string meth(method);
-                // response not sent, because we did not receive any POST data yet.
-                // ptr is now set, we can return and wait for data to arrive.
-                if(meth == "POST" and upload_data == nullptr and state->response_data.empty()) {
+            auto const response_params = createResponse(connection, url, method, upload_data, upload_data_size,
+                                                        ptr,
+                                                        response_ss);
 
-                    // request timeout - empty request
-                    if(++state->request_waiting_loop_counter > DynamicController::waiting_loops)
-                        return MHD_NO;
+            // we should not continue with connection, bail out now
+            if(response_params.response_code == MHD_NO) {
+                return false;
+            }
 
-                    timespec remaining;
-                    nanosleep(&DynamicController::waiting_usec_sleep, &remaining);
+            // copy straight to arena, str() would make temporary copy
+            auto* buf = response_ss.rdbuf();
+            auto const len = buf->pubseekoff(0, std::ios::end, std::ios::out);
+            if(len > 0) {
+                state.response_data.resize(static_cast<size_t>(len));
+                buf->sgetn(state.response_data.data(), len);
+            }
 
-                    // we don't care if we won't succeed with sleep, we will get here multiple times
-                    // so few cycles more doesn't matter.
+            state.response_headers.reserve(response_params.headers.size());
+            for(auto const& [hdr, hdr_val]: response_params.headers) {
+                state.response_headers.emplace_back(hdr, hdr_val);
+            }
+            state.response_created = true;
+            return true;
+        }
 
-                    return MHD_YES;
+        std::shared_ptr<WorkerPool> const& workers() const { return workers_; }
+
+    private:
+        void start_offloaded(struct MHD_Connection* connection, const char* url, const char* method,
+                             const char* upload_data, size_t* upload_data_size, ConnectionState* state) {
+
+            // upload data are valid only during this call
+            bool const has_upload = upload_data != nullptr;
+            if(has_upload) state->request_data.assign(upload_data, *upload_data_size);
+            size_t const upload_size = *upload_data_size;
+            *upload_data_size = 0;
+
+            state->offloaded = true;
+            suspend_connection(connection);
+
+            // url and method stay valid until request completes
+            workers_->submit([this, connection, url, method, state, has_upload, upload_size]() {
+                void* p = state;
+                size_t size = upload_size;
+                auto const ok = create(connection, url, method, has_upload ? state->request_data.data() : nullptr,
+                                       &size, &p, *state);
+                state->offload_failed = not ok;
+
+                if(state->flight) {
+                    coalescer_.finish(state->flight, ok ? makeResponse(*state) : nullptr, MHD_HTTP_OK);
                 }
 
-                // it response is not created yet, call createResponse & co
-                if(state->response_data.empty()) {
-                    std::stringstream response_ss;
-                    auto const response_params = createResponse(connection, url, method, upload_data, upload_data_size,
-                                                                ptr,
-                                                                response_ss);
-
-                    // we should not continue with connection, bail out now
-                    if(response_params.response_code == MHD_NO) {
-                        return MHD_NO;
-                    } else {
-                        state->response_data = response_ss.str();
-                        state->response_headers = response_params.headers;
-                    }
+                resume_connection(connection);
+                {
+                    auto l_ = std::lock_guard(offload_lock_);
+                    state->offloaded = false;
                 }
+                offload_done_.notify_all();
+            }, priority());
+        }
 
-                auto *response = MHD_create_response_from_buffer(
-                        state->response_data.size(),
-                        (void *) state->response_data.c_str(), MHD_RESPMEM_MUST_COPY);
+        std::shared_ptr<WorkerPool> workers_;
+        Coalescer coalescer_;
 
-                            for(auto const& [hdr, hdr_val]: state->response_headers ) {
-                                MHD_add_response_header(response, hdr.c_str(), hdr_val.c_str());
-                            }
+        std::mutex offload_lock_;
+        std::condition_variable offload_done_;
+    };
 
-                ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-                if (ret == MHD_YES) {
-                    state->response_sent = true;
-                }
+/**
+ * Dynamic controller which produces response body as a list of segments, static parts are never copied.
+ */
+    class SegmentedController: public DynamicController {
+    public:
+        /**
+         * User defined http response, filled into segmented body.
+         */
+        virtual ResponseParams createSegments(struct MHD_Connection* connection,
+                                    const char* url, const char* method, const char* upload_data,
+                                    size_t* upload_data_size, void** ptr, ResponseBody& body) = 0;
 
-                MHD_destroy_response(response);
-            }
+        ResponseParams createResponse(struct MHD_Connection* connection,
+                                      const char* url, const char* method, const char* upload_data,
+                                      size_t* upload_data_size, void** ptr, std::stringstream&) final {
 
-            // except handlers won't say otherwise, we continue with connection
-            return MHD_YES;
+            auto* state = reinterpret_cast<lmh::ConnectionState*>(*ptr);
+            return createSegments(connection, url, method, upload_data, upload_data_size, ptr, state->response_body);
+        }
+
+    protected:
+        MHD_Response* buildResponse(ConnectionState& state) override {
+            return state.response_body.create_response();
         }
     };
 
@@ -192,12 +1461,61 @@ namespace lmh {
             std::string bind_address;
             std::string bind_interface;
 
+            // listen on unix domain socket instead of TCP port, "@name" is abstract socket
+            std::string unix_socket;
+            mode_t unix_socket_mode = 0;                  // permissions of socket file, 0 keeps umask ones
+
+            // socket tuning, applied best effort; 0 (-1 for cpu) leaves kernel default
+            struct socket_options_t {
+                int backlog = SOMAXCONN;
+                int fastopen_queue = 0;                   // TCP_FASTOPEN, pending connections with data in SYN
+                int defer_accept = 0;                     // TCP_DEFER_ACCEPT, seconds to wait for request data
+                int recv_buffer = 0;                      // SO_RCVBUF and SO_SNDBUF, inherited by accepted sockets
+                int send_buffer = 0;
+                bool nodelay = false;                     // TCP_NODELAY on accepted sockets
+                int incoming_cpu = -1;                    // SO_INCOMING_CPU
+                int busy_poll = 0;                        // SO_BUSY_POLL on accepted sockets, microseconds
+            } socket;
+
             std::optional<std::pair<std::string, std::string>> certificate;
 
             // optional handlers
             std::optional<std::function<bool()>> handler_should_terminate;
             std::vector<std::string> allowed_ips = { "*", };
 
+            // checked on accept, before anything is allocated for connection; false closes it
+            std::function<bool(sockaddr const*, socklen_t)> accept_policy;
+
+            // keep-alive and pipelining, 0 means libmicrohttpd default
+            unsigned int connection_timeout = 0;          // idle seconds before keep-alive connection is closed
+            size_t connection_memory_limit = 0;           // per connection buffer, bigger one holds more pipelined requests
+            size_t connection_memory_increment = 0;
+
+            // worker pool for offloaded work, connections can be suspended while it runs
+            size_t worker_threads = 0;
+            WorkerPool::options_t worker_options;        // priority weights and threads reserved for critical routes
+
+            // more than one runs libmicrohttpd thread pool, each thread with its own epoll
+            unsigned int daemon_threads = 0;
+
+            // daemon threads are pinned to these cpus in turn, workers to worker_cpus (cpus if empty);
+            // put cpus of one NUMA node (CpuAffinity::node_cpus()) or of NIC's RSS queues here
+            std::vector<int> cpus;
+            std::vector<int> worker_cpus;
+
+            // daemon gets random nonce secret for DigestAuthenticator
+            bool digest_auth = false;
+
+            // with certificate: CA (PEM) client certificates are verified against, clients are asked for one
+            std::string client_ca;
+
+            // for controllers without their own authenticator
+            std::shared_ptr<Authenticator> authenticator;
+
+            // start() stops accepting on termination and waits up to this long for in-flight requests, 0 stops at once
+            std::chrono::milliseconds drain_timeout{0};
+
+            // unix socket peers are "unix", or "uid:<n>" with uid from SO_PEERCRED
             bool is_allowed_ip(std::string_view ip) const {
                 return std::any_of(allowed_ips.begin(), allowed_ips.end(),
                                    [&](auto const& it){
@@ -213,37 +1531,343 @@ namespace lmh {
         /** List of controllers this server has. */
         std::vector<std::shared_ptr<Controller>> controllers;
 
+        std::shared_ptr<WorkerPool> workers_;
+        std::shared_ptr<CpuAffinity> affinity_;
+        std::string digest_random_;
+
+        // requests which reached request_handler and are not completed yet
+        std::atomic<size_t> in_flight_ = 0;
+
+        // connections suspended by suspend_connection() and not resumed yet
+        std::atomic<size_t> suspended_ = 0;
+
+        // daemon is being drained or stopped, new requests are turned away
+        std::atomic<bool> draining_ = false;
+
         static int request_handler(void * cls, struct MHD_Connection * connection,
                                    const char * url, const char * method, const char * version,
                                    const char * upload_data, size_t * upload_data_size, void ** ptr) {
 
 
-            auto const* server = static_cast<WebServer*>(cls);
+            // next calls for the same request go straight to the controller which took it
+            if(*ptr) {
+                auto* state = static_cast<ConnectionState*>(*ptr);
+                return state->conroller.handleRequest(connection, url, method, upload_data, upload_data_size, ptr);
+            }
+
+            auto* server = static_cast<WebServer*>(cls);
+            auto* ctx = ConnectionContext::of(connection);
+
+            // first call for request, the completion of which is reported
+            if(ctx and not ctx->in_flight) {
+                ctx->in_flight = true;
+                ++server->in_flight_;
+            }
+
+            if(ctx and ctx->bulkhead_refused) {
+                ctx->bulkhead_refused = false;
+                return queue_empty_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE);
+            }
+
+            // request holding bulkhead slot already passed routing and authentication, queued one waits
+            if(ctx and ctx->bulkhead) {
+                if(ctx->bulkhead_queued) return MHD_YES;
+                return ctx->bulkhead_controller->handleRequest(connection, url, method, upload_data, upload_data_size, ptr);
+            }
+
+            // keep-alive connections still send requests to quiesced daemon, they must not start anything
+            if(server->draining_) {
+                return queue_empty_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE, true);
+            }
+
+            if(ctx) ++ctx->requests;
+
+            // peer doesn't change on keep-alive connection, check it once
+            bool allowed = false;
+            if(ctx and ctx->ip_allowed.has_value()) {
+                allowed = ctx->ip_allowed.value();
+            }
+            else {
+                allowed = server->is_ip_allowed(connection);
+                if(ctx) ctx->ip_allowed = allowed;
+            }
+
+            if (!allowed) {
+                return queue_empty_response(connection, MHD_HTTP_FORBIDDEN);
+            }
+
+
+            auto const d = server->dispatch(connection, url, parse_method(method), method);
+
+            switch(d.verdict) {
+                case Dispatch::RUN:
+                    return d.controller->handleRequest(connection, url, method, upload_data, upload_data_size, ptr);
+                case Dispatch::UNAUTHORIZED:
+                    return d.authenticator->reject(connection);
+                case Dispatch::QUEUED:
+                    return MHD_YES;
+                case Dispatch::UNAVAILABLE:
+                    return queue_empty_response(connection, MHD_HTTP_SERVICE_UNAVAILABLE);
+                default:
+                    return queue_empty_response(connection, MHD_HTTP_NOT_FOUND);
+            }
+        }
+
+        /**
+         * Takes bulkhead slot for request. Connection context remembers admitted request, so the next calls
+         * for it (with *ptr still empty) and the call after it's resumed from the queue go straight through.
+         */
+        static Bulkhead::admit_t admit(Controller& c, struct MHD_Connection* connection, ConnectionContext* ctx) {
+            auto const& bulkhead = c.bulkhead();
+            if(not bulkhead or not ctx) return Bulkhead::admit_t::ADMITTED;
+
+            // set before admit(), queued connection can be resumed by other thread right after it returns
+            ctx->bulkhead = bulkhead;
+            ctx->bulkhead_controller = &c;
+            ctx->bulkhead_queued = true;
+
+            // queued connection is not touched after admit(), it belongs to thread resuming it
+            auto const ret = bulkhead->admit(connection);
+            if(ret == Bulkhead::admit_t::ADMITTED) {
+                ctx->bulkhead_queued = false;
+            }
+            else if(ret == Bulkhead::admit_t::REJECTED) {
+                ctx->bulkhead.reset();
+                ctx->bulkhead_controller = nullptr;
+                ctx->bulkhead_queued = false;
+            }
+            return ret;
+        }
+
+        static void release(struct MHD_Connection* connection) {
+            auto* ctx = ConnectionContext::of(connection);
+            if(not ctx or not ctx->bulkhead) return;
 
-            if (!server->is_ip_allowed(connection)) {
-                return MHD_queue_response(connection, MHD_HTTP_FORBIDDEN,
-                                          MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT));
+            auto bulkhead = std::move(ctx->bulkhead);
+            ctx->bulkhead.reset();
+            ctx->bulkhead_controller = nullptr;
+
+            if(ctx->bulkhead_queued) {
+                ctx->bulkhead_queued = false;
+                bulkhead->cancel(connection);
+                return;
             }
 
+            release_slot(bulkhead);
+        }
 
-            for(auto const& c: server->controllers){
-                if(c and c->validPath(url, method)){
-                    return c->handleRequest(connection, url, method, upload_data, upload_data_size, ptr);
+        /**
+         * Resumes requests waiting in bulkhead queues, to be answered 503. Daemon can't stop with them suspended.
+         */
+        void refuse_waiting() const {
+            for(auto const& c: controllers) {
+                if(not c or not c->bulkhead()) continue;
+
+                for(auto* waiting: c->bulkhead()->take_waiting()) {
+                    if(auto* ctx = ConnectionContext::of(waiting); ctx) {
+                        ctx->bulkhead.reset();
+                        ctx->bulkhead_controller = nullptr;
+                        ctx->bulkhead_queued = false;
+                        ctx->bulkhead_refused = true;
+                    }
+                    resume_connection(waiting);
                 }
             }
+        }
+
+        // stop_daemon() without onStop(), also used to reset daemon which is about to be started again;
+        // false if connections were still suspended at deadline, daemon is left running then
+        bool halt_daemon(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+            if(not daemon_) return true;
+            draining_ = true;
+
+            // libmicrohttpd can't stop with suspended connections: bulkhead waiters are answered 503,
+            // offloaded work and pending reads (resumed by other threads than workers) are waited for
+            refuse_waiting();
+            if(workers_ and not workers_->wait_idle(deadline)) return false;
+            while(suspended_ > 0) {
+                if(std::chrono::steady_clock::now() >= deadline) return false;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+
+            MHD_stop_daemon(daemon_);
+            daemon_ = nullptr;
+
+            if(not options().unix_socket.empty() and options().unix_socket.front() != '@')
+                ::unlink(options().unix_socket.c_str());
+            return true;
+        }
+
+        void notify_stop() {
+            for(auto const& c: controllers) {
+                if(c) c->onStop();
+            }
+        }
+
+        static int accept_handler(void* cls, const sockaddr* addr, socklen_t addrlen) {
+            auto const* server = static_cast<WebServer*>(cls);
+            return server->options().accept_policy(addr, addrlen) ? MHD_YES : MHD_NO;
+        }
 
-            struct MHD_Response* response = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
-            return MHD_queue_response (connection, MHD_HTTP_NOT_FOUND, response);
+        static int queue_empty_response(struct MHD_Connection* connection, unsigned int status, bool close = false) {
+            auto* response = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+            if(close) MHD_add_response_header(response, MHD_HTTP_HEADER_CONNECTION, "close");
+            auto ret = MHD_queue_response(connection, status, response);
+            MHD_destroy_response(response);
+            return ret;
+        }
+
+        static void connection_notify_handler(void *cls, struct MHD_Connection* connection, void **socket_context,
+                                              enum MHD_ConnectionNotificationCode toe) {
+            if(toe == MHD_CONNECTION_NOTIFY_STARTED) {
+                auto* server = static_cast<WebServer*>(cls);
+
+                // libmicrohttpd has no thread start hook: pin on first connection of this daemon thread,
+                // its thread state and this connection's pool are already allocated
+                if(server->affinity_) server->affinity_->pin_once();
+
+                auto* ctx = new ConnectionContext();
+                ctx->suspended = &server->suspended_;
+                *socket_context = ctx;
+                server->tune_connection(connection);
+            }
+            else if(toe == MHD_CONNECTION_NOTIFY_CLOSED) {
+                delete static_cast<ConnectionContext*>(*socket_context);
+                *socket_context = nullptr;
+            }
         }
 
         static void request_complete_handler(void *cls, struct MHD_Connection* connection, void **con_cls, enum MHD_RequestTerminationCode toe) {
 
+            // completion of request rejected by libmicrohttpd before reaching request_handler isn't reported
+            if(auto* ctx = ConnectionContext::of(connection); ctx and ctx->in_flight) {
+                ctx->in_flight = false;
+                --static_cast<WebServer*>(cls)->in_flight_;
+            }
+            release(connection);
+
             auto* cs = static_cast<struct ConnectionState*>(*con_cls);
 
             if(cs)
                 cs->conroller.handleComplete(connection, toe, cs);
         }
 
+        static void set_option(int fd, int level, int name, int value) {
+            setsockopt(fd, level, name, &value, sizeof(value));
+        }
+
+        // before bind and listen: buffer sizes decide TCP window scale of accepted connections
+        void tune_listen_socket(int fd, bool tcp) const {
+            auto const& so = options().socket;
+
+            if(so.recv_buffer) set_option(fd, SOL_SOCKET, SO_RCVBUF, so.recv_buffer);
+            if(so.send_buffer) set_option(fd, SOL_SOCKET, SO_SNDBUF, so.send_buffer);
+            if(so.incoming_cpu >= 0) set_option(fd, SOL_SOCKET, SO_INCOMING_CPU, so.incoming_cpu);
+
+            if(not tcp) return;
+
+            if(so.fastopen_queue) set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, so.fastopen_queue);
+            if(so.defer_accept) set_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, so.defer_accept);
+        }
+
+        void tune_connection(MHD_Connection* connection) const {
+            auto const& so = options().socket;
+            if(not so.nodelay and not so.busy_poll and so.incoming_cpu < 0) return;
+
+            auto const* ci = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CONNECTION_FD);
+            if(not ci) return;
+
+            if(so.nodelay) set_option(ci->connect_fd, IPPROTO_TCP, TCP_NODELAY, 1);
+            if(so.busy_poll) set_option(ci->connect_fd, SOL_SOCKET, SO_BUSY_POLL, so.busy_poll);
+            if(so.incoming_cpu >= 0) set_option(ci->connect_fd, SOL_SOCKET, SO_INCOMING_CPU, so.incoming_cpu);
+        }
+
+        int open_tcp_socket() const {
+            sockaddr_in bind_addr{};
+
+            memset(&bind_addr, 0, sizeof(bind_addr));
+            bind_addr.sin_family = AF_INET;
+            bind_addr.sin_port = htons(port_);
+            if(options().bind_loopback) {
+                bind_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            }
+            else {
+                if(! options().bind_address.empty())
+                    inet_pton(AF_INET, options().bind_address.c_str(), &bind_addr.sin_addr);
+            }
+
+            auto listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+            if (listen_socket == -1) {
+                return -1;
+            }
+
+            if(! options().bind_interface.empty()) {
+                auto ret = setsockopt(listen_socket, SOL_SOCKET, SO_BINDTODEVICE, options().bind_interface.c_str(),
+                           static_cast<unsigned int>(options().bind_interface.size()));
+                if(ret < 0) {
+                    close(listen_socket);
+                    return -1;
+                }
+            }
+
+            tune_listen_socket(listen_socket, true);
+
+            if (bind(listen_socket, (sockaddr*)&bind_addr, sizeof(bind_addr)) == -1 or
+                listen(listen_socket, options().socket.backlog) == -1) {
+                close(listen_socket);
+                return -1;
+            }
+            return listen_socket;
+        }
+
+        static bool stale_unix_socket(sockaddr_un const& addr, socklen_t addr_len) {
+            auto probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if(probe == -1) return false;
+
+            bool const stale = connect(probe, reinterpret_cast<sockaddr const*>(&addr), addr_len) == -1 and errno == ECONNREFUSED;
+            close(probe);
+            return stale;
+        }
+
+        int open_unix_socket() const {
+            auto const& path = options().unix_socket;
+
+            sockaddr_un bind_addr{};
+            bind_addr.sun_family = AF_UNIX;
+            if(path.size() >= sizeof(bind_addr.sun_path)) {
+                return -1;
+            }
+            memcpy(bind_addr.sun_path, path.data(), path.size());
+
+            bool const abstract = path.front() == '@';
+            auto addr_len = static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + path.size() + (abstract ? 0 : 1));
+            if(abstract) {
+                bind_addr.sun_path[0] = '\0';
+            }
+            else {
+                // socket left behind by previous run would fail bind; live one (something accepts on it)
+                // and other files are not touched
+                struct stat st{};
+                if(::lstat(path.c_str(), &st) == 0 and S_ISSOCK(st.st_mode) and stale_unix_socket(bind_addr, addr_len))
+                    ::unlink(path.c_str());
+            }
+
+            auto listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (listen_socket == -1) {
+                return -1;
+            }
+
+            tune_listen_socket(listen_socket, false);
+
+            if (bind(listen_socket, (sockaddr*)&bind_addr, addr_len) == -1 or
+                (not abstract and options().unix_socket_mode and ::chmod(path.c_str(), options().unix_socket_mode) == -1) or
+                listen(listen_socket, options().socket.backlog) == -1) {
+                close(listen_socket);
+                return -1;
+            }
+            return listen_socket;
+        }
+
     public:
         explicit WebServer(uint16_t p) : port_(p) {};
 
@@ -255,6 +1879,122 @@ namespace lmh {
             controllers.emplace_back(controller);
         };
 
+        /**
+         * Finds controller for path and method, method_str is needed only for Method::OTHER.
+         */
+        std::shared_ptr<Controller> const& route(const char* url, Method m, const char* method_str = "") const {
+            static const std::shared_ptr<Controller> none;
+
+            for(auto const& c: controllers){
+                if(not c or not c->methods().contains(m)) continue;
+
+                if(m == Method::OTHER ? c->validPath(url, method_str) : c->validRoute(url, m)){
+                    return c;
+                }
+            }
+            return none;
+        }
+
+        /**
+         * Result of dispatch(): controller to run request with, or why the request is answered without it.
+         */
+        struct Dispatch {
+            enum verdict_t { RUN, NOT_FOUND, UNAUTHORIZED, QUEUED, UNAVAILABLE };
+
+            verdict_t verdict = NOT_FOUND;
+            Controller* controller = nullptr;
+            std::shared_ptr<Authenticator> authenticator;     // the one which refused request
+            std::shared_ptr<Identity const> identity;
+            std::shared_ptr<Bulkhead> slot;                   // bulkhead slot of request part, see release_slot()
+        };
+
+        /**
+         * Steps every request goes through before its controller runs: routing, authentication, bulkhead admission.
+         * Request on connection keeps identity and slot in its ConnectionContext, bulkhead may queue it (QUEUED).
+         * Request part (batch sub-request) is never queued, its identity and slot are kept in the result
+         * and the slot must be given back with release_slot().
+         */
+        Dispatch dispatch(struct MHD_Connection* connection, const char* url, Method m, const char* method_str,
+                          bool part = false) const {
+            Dispatch d;
+
+            auto const& c = route(url, m, method_str);
+            if(not c) return d;
+            d.controller = c.get();
+
+            auto* ctx = part ? nullptr : ConnectionContext::of(connection);
+
+            // route without own timeout gets the daemon one back, if previous request on connection changed it
+            if(ctx) {
+                auto const timeout = c->connection_timeout();
+                if(ctx->timeout != timeout) {
+                    MHD_set_connection_option(connection, MHD_CONNECTION_OPTION_TIMEOUT,
+                                              timeout ? timeout : options().connection_timeout);
+                    ctx->timeout = timeout;
+                }
+            }
+
+            // identity belongs to request, not to keep-alive connection
+            if(ctx) ctx->identity.reset();
+
+            auto const& auth = c->authenticator() ? c->authenticator() : options().authenticator;
+            if(auth) {
+                d.identity = auth->authenticate(connection);
+                if(not d.identity) {
+                    d.verdict = Dispatch::UNAUTHORIZED;
+                    d.authenticator = auth;
+                    return d;
+                }
+                if(ctx) ctx->identity = d.identity;
+            }
+
+            d.verdict = Dispatch::RUN;
+            if(part) {
+                if(auto const& bulkhead = c->bulkhead(); bulkhead) {
+                    if(not bulkhead->try_acquire())
+                        d.verdict = Dispatch::UNAVAILABLE;
+                    else
+                        d.slot = bulkhead;
+                }
+                return d;
+            }
+
+            switch(admit(*c, connection, ctx)) {
+                case Bulkhead::admit_t::QUEUED:
+                    d.verdict = Dispatch::QUEUED;
+                    break;
+                case Bulkhead::admit_t::REJECTED:
+                    d.verdict = Dispatch::UNAVAILABLE;
+                    break;
+                default:
+                    break;
+            }
+            return d;
+        }
+
+        /**
+         * Gives back bulkhead slot, passing it to the oldest waiting request if there is one.
+         */
+        static void release_slot(std::shared_ptr<Bulkhead> const& bulkhead) {
+            if(not bulkhead) return;
+
+            if(auto* next = bulkhead->release(); next) {
+                if(auto* next_ctx = ConnectionContext::of(next); next_ctx)
+                    next_ctx->bulkhead_queued = false;
+                resume_connection(next);
+            }
+        }
+
+        /**
+         * Worker pool, created by start_daemon() if options().worker_threads is set.
+         */
+        std::shared_ptr<WorkerPool> const& workers() const { return workers_; }
+
+        /**
+         * Requests being processed, including suspended ones.
+         */
+        size_t in_flight() const { return in_flight_; }
+
         bool is_daemon_alive() {
 
             auto const* fd_info = MHD_get_daemon_info(daemon_, MHD_DAEMON_INFO_LISTEN_FD);
@@ -266,7 +2006,7 @@ namespace lmh {
 
         void start_daemon() {
 
-            stop_daemon();
+            halt_daemon();
 
             auto sleepy = [](auto l) {
                 timespec ts{};
@@ -276,77 +2016,88 @@ namespace lmh {
 
             int attempts = 12;
             while(! daemon_ && attempts >= 0) {
-                sockaddr_in bind_addr{};
-
-                memset(&bind_addr, 0, sizeof(bind_addr));
-                bind_addr.sin_family = AF_INET;
-                bind_addr.sin_port = htons(port_);
-                if(options().bind_loopback) {
-                    bind_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-                }
-                else {
-                    if(! options().bind_address.empty())
-                        inet_pton(AF_INET, options().bind_address.c_str(), &bind_addr.sin_addr);
-                }
-
-                auto listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+                auto listen_socket = options().unix_socket.empty() ? open_tcp_socket() : open_unix_socket();
                 if (listen_socket == -1) {
                     sleepy(5);
                     continue;
                 }
 
-                if(! options().bind_interface.empty()) {
-                    auto ret = setsockopt(listen_socket, SOL_SOCKET, SO_BINDTODEVICE, options().bind_interface.c_str(),
-                               static_cast<unsigned int>(options().bind_interface.size()));
-                    if(ret < 0) {
-                        close(listen_socket);
-                        sleepy(5);
-                        continue;
+                // quiescing daemon with internal thread needs inter-thread communication channel
+                unsigned int flags = MHD_USE_EPOLL_INTERNALLY | MHD_USE_ITC;
+
+                bool const suspending = std::any_of(controllers.begin(), controllers.end(), [](auto const& c) {
+                    return c and (c->suspends() or (c->bulkhead() and c->bulkhead()->options().max_queued > 0));
+                });
+                if(suspending)
+                    flags |= MHD_ALLOW_SUSPEND_RESUME;
+
+                if(options().worker_threads > 0) {
+                    flags |= MHD_ALLOW_SUSPEND_RESUME;
+                    if(not workers_) {
+                        auto const& cpus = options().worker_cpus.empty() ? options().cpus : options().worker_cpus;
+                        workers_ = std::make_shared<WorkerPool>(options().worker_threads, options().worker_options,
+                                                                cpus.empty() ? nullptr : std::make_shared<CpuAffinity>(cpus));
                     }
                 }
 
-                if (bind(listen_socket, (sockaddr*)&bind_addr, sizeof(bind_addr)) == -1) {
-                    close(listen_socket);
-                    sleepy(5);
-                    continue;
+                std::vector<MHD_OptionItem> daemon_options;
+                auto add_option = [&daemon_options](MHD_OPTION option, intptr_t value, void* ptr_value = nullptr) {
+                    daemon_options.push_back({ option, value, ptr_value });
+                };
+
+                add_option(MHD_OPTION_LISTEN_SOCKET, listen_socket);
+
+                if(options().daemon_threads > 1)
+                    add_option(MHD_OPTION_THREAD_POOL_SIZE, options().daemon_threads);
+
+                // connections of stopped daemon are gone
+                in_flight_ = 0;
+                suspended_ = 0;
+                draining_ = false;
+
+                // fresh rotation for new daemon threads
+                affinity_ = options().cpus.empty() ? nullptr : std::make_shared<CpuAffinity>(options().cpus);
+                add_option(MHD_OPTION_NOTIFY_COMPLETED, reinterpret_cast<intptr_t>(&request_complete_handler), this);
+                add_option(MHD_OPTION_NOTIFY_CONNECTION, reinterpret_cast<intptr_t>(&connection_notify_handler), this);
+
+                if(options().connection_timeout)
+                    add_option(MHD_OPTION_CONNECTION_TIMEOUT, options().connection_timeout);
+                if(options().connection_memory_limit)
+                    add_option(MHD_OPTION_CONNECTION_MEMORY_LIMIT, static_cast<intptr_t>(options().connection_memory_limit));
+                if(options().connection_memory_increment)
+                    add_option(MHD_OPTION_CONNECTION_MEMORY_INCREMENT, static_cast<intptr_t>(options().connection_memory_increment));
+
+                if(options().digest_auth) {
+                    if(digest_random_.empty()) {
+                        std::random_device rd;
+                        for(size_t i = 0; i < 32; ++i) digest_random_.push_back(static_cast<char>(rd()));
+                    }
+                    add_option(MHD_OPTION_DIGEST_AUTH_RANDOM, static_cast<intptr_t>(digest_random_.size()), digest_random_.data());
                 }
 
-                if (listen(listen_socket, SOMAXCONN) == -1) {
-                    close(listen_socket);
-                    sleepy(5);
-                    continue;
+                if(options().certificate.has_value()) {
+                    flags |= MHD_USE_SSL;
+                    add_option(MHD_OPTION_HTTPS_MEM_KEY, 0, const_cast<char*>(options().certificate->first.c_str()));
+                    add_option(MHD_OPTION_HTTPS_MEM_CERT, 0, const_cast<char*>(options().certificate->second.c_str()));
+                    if(not options().client_ca.empty())
+                        add_option(MHD_OPTION_HTTPS_MEM_TRUST, 0, const_cast<char*>(options().client_ca.c_str()));
                 }
 
-                if(options().certificate.has_value()) {
+                add_option(MHD_OPTION_END, 0);
 
-                    auto key_src = options().certificate->first;
-                    auto cert_src = options().certificate->second;
-
-                    daemon_ = MHD_start_daemon(MHD_USE_EPOLL_INTERNALLY | MHD_USE_SSL,
-                                               port_, nullptr, nullptr,
-                                               reinterpret_cast<MHD_AccessHandlerCallback>(&request_handler),
-                                               this,
-                                               MHD_OPTION_LISTEN_SOCKET, listen_socket,
-                                               MHD_OPTION_NOTIFY_COMPLETED,
-                                               reinterpret_cast<MHD_RequestCompletedCallback>(request_complete_handler),
-                                               nullptr,
-                                               MHD_OPTION_HTTPS_MEM_KEY, key_src.c_str(),
-                                               MHD_OPTION_HTTPS_MEM_CERT, cert_src.c_str(),
-                                               MHD_OPTION_END);
-
-                } else {
-                    daemon_ = MHD_start_daemon(MHD_USE_EPOLL_INTERNALLY,
-                                               port_, nullptr, nullptr,
-                                               reinterpret_cast<MHD_AccessHandlerCallback>(&request_handler),
-                                               this,
-                                               MHD_OPTION_LISTEN_SOCKET, listen_socket,
-                                               MHD_OPTION_NOTIFY_COMPLETED,
-                                               reinterpret_cast<MHD_RequestCompletedCallback>(request_complete_handler),
-                                               nullptr,
-                                               MHD_OPTION_END);
-                }
+                daemon_ = MHD_start_daemon(flags,
+                                           port_,
+                                           options().accept_policy ? reinterpret_cast<MHD_AcceptPolicyCallback>(&accept_handler) : nullptr,
+                                           this,
+                                           reinterpret_cast<MHD_AccessHandlerCallback>(&request_handler),
+                                           this,
+                                           MHD_OPTION_ARRAY, daemon_options.data(),
+                                           MHD_OPTION_END);
 
                 if(! daemon_) {
+                    // listen socket is daemon's only if it started
+                    close(listen_socket);
+
                     timespec wait{};
                     timespec remain{};
                     wait.tv_sec = 5;
@@ -357,9 +2108,44 @@ namespace lmh {
             }
         }
 
+        /**
+         * Stops daemon, requests waiting in bulkhead queues are turned away first. Requests offloaded
+         * to workers and pending reads are waited for, libmicrohttpd can't stop with suspended connections.
+         */
         void stop_daemon() {
-            if(daemon_)
-                MHD_stop_daemon(daemon_);
+            if(not daemon_) return;
+            halt_daemon();
+            notify_stop();
+        }
+
+        /**
+         * Stops accepting new connections, waits until in-flight requests complete or timeout expires, then stops daemon.
+         * New requests on open keep-alive connections get 503 and the connection is closed.
+         * Returns false if some requests were still running and got terminated.
+         *
+         * Requests left at timeout are terminated, but suspended ones have to be resumed first: bulkhead waiters
+         * are answered 503, offloaded work and pending reads are waited for (they can't be interrupted), again
+         * at most timeout. If they are still suspended then, the daemon is left running (quiesced) and not stopped.
+         */
+        bool drain_daemon(std::chrono::milliseconds timeout) {
+            if(not daemon_) return true;
+
+            // listen socket is not closed by quiesced daemon, it's ours again
+            auto const listen_socket = MHD_quiesce_daemon(daemon_);
+            draining_ = true;
+
+            auto const deadline = std::chrono::steady_clock::now() + timeout;
+            while(in_flight_ > 0 and std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            bool const drained = in_flight_ == 0;
+
+            bool const stopped = halt_daemon(std::chrono::steady_clock::now() + timeout);
+            if(stopped) notify_stop();
+            if(listen_socket != MHD_INVALID_SOCKET)
+                close(listen_socket);
+
+            return drained and stopped;
         }
 
         int start(){
@@ -384,7 +2170,10 @@ namespace lmh {
                 }
             }
 
-            stop_daemon();
+            if(options().drain_timeout.count() > 0)
+                drain_daemon(options().drain_timeout);
+            else
+                stop_daemon();
             return true;
         }
 
@@ -407,6 +2196,9 @@ namespace lmh {
                 auto *addr = (struct sockaddr_in6 const*) ci->client_addr;
                 inet_ntop(AF_INET6, &addr->sin6_addr, client_ip.data(), client_ip.size());
             }
+            else if (ci->client_addr->sa_family == AF_UNIX) { // local peer, unix socket has no address
+                return "unix";
+            }
             else {
                 return ip;
             }
@@ -415,10 +2207,35 @@ namespace lmh {
             return ip;
         }
 
+        /**
+         * Credentials of peer connected over unix socket.
+         */
+        static std::optional<ucred> peer_credentials(MHD_Connection *connection) {
+            auto const* ci = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CONNECTION_FD);
+            if (nullptr == ci) {
+                return std::nullopt;
+            }
+
+            ucred cred{};
+            socklen_t len = sizeof(cred);
+            if (getsockopt(ci->connect_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 or len != sizeof(cred)) {
+                return std::nullopt;
+            }
+            return cred;
+        }
+
         bool is_ip_allowed(MHD_Connection *connection) const {
 
             auto ip = connection_ip(connection);
-            return options().is_allowed_ip(ip);
+            if(options().is_allowed_ip(ip)) {
+                return true;
+            }
+
+            if(ip == "unix") {
+                auto const cred = peer_credentials(connection);
+                return cred and options().is_allowed_ip("uid:" + std::to_string(cred->uid));
+            }
+            return false;
         }
     };
 }
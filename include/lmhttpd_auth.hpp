@@ -0,0 +1,656 @@
+/*
+ *
+Copyright (c) 2021, Ales Stibal <astib@mag0.net>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+        modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+        IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+        FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+        DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+        SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+        CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#ifndef LMHTTPD_AUTH_HPP
+#define LMHTTPD_AUTH_HPP
+
+#include <openssl/core_names.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <strings.h>
+
+#include <lmhttpd.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace lmh {
+
+    namespace detail {
+        inline bool base64url_decode(std::string_view in, std::string& out) {
+            out.clear();
+            out.reserve(in.size() * 3 / 4);
+
+            uint32_t acc = 0;
+            int bits = 0;
+            for(auto c: in) {
+                int v;
+                if(c >= 'A' and c <= 'Z') v = c - 'A';
+                else if(c >= 'a' and c <= 'z') v = c - 'a' + 26;
+                else if(c >= '0' and c <= '9') v = c - '0' + 52;
+                else if(c == '-' or c == '+') v = 62;
+                else if(c == '_' or c == '/') v = 63;
+                else if(c == '=') break;
+                else return false;
+
+                acc = (acc << 6) | static_cast<uint32_t>(v);
+                bits += 6;
+                if(bits >= 8) {
+                    bits -= 8;
+                    out.push_back(static_cast<char>((acc >> bits) & 0xff));
+                }
+            }
+            return true;
+        }
+
+        /**
+         * Top level members of JSON object. Strings are unescaped, other values are kept as they are.
+         */
+        inline bool parse_json_object(std::string_view in, std::vector<std::pair<std::string, std::string>>& out) {
+            size_t i = 0;
+            auto ws = [&]() { while(i < in.size() and isspace(static_cast<unsigned char>(in[i]))) ++i; };
+
+            auto string = [&](std::string& s) {
+                if(i >= in.size() or in[i] != '"') return false;
+                for(++i; i < in.size(); ++i) {
+                    auto c = in[i];
+                    if(c == '"') { ++i; return true; }
+                    if(c != '\\') { s.push_back(c); continue; }
+
+                    if(++i >= in.size()) return false;
+                    switch(in[i]) {
+                        case 'b': s.push_back('\b'); break;
+                        case 'f': s.push_back('\f'); break;
+                        case 'n': s.push_back('\n'); break;
+                        case 'r': s.push_back('\r'); break;
+                        case 't': s.push_back('\t'); break;
+                        case 'u': {
+                            if(i + 4 >= in.size()) return false;
+                            char hex[5] = { in[i + 1], in[i + 2], in[i + 3], in[i + 4], '\0' };
+                            char* end = nullptr;
+                            auto const cp = std::strtoul(hex, &end, 16);
+                            if(end != hex + 4) return false;
+                            i += 4;
+                            if(cp < 0x80) s.push_back(static_cast<char>(cp));
+                            else if(cp < 0x800) {
+                                s.push_back(static_cast<char>(0xc0 | (cp >> 6)));
+                                s.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+                            }
+                            else {
+                                s.push_back(static_cast<char>(0xe0 | (cp >> 12)));
+                                s.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+                                s.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+                            }
+                            break;
+                        }
+                        default: s.push_back(in[i]);
+                    }
+                }
+                return false;
+            };
+
+            ws();
+            if(i >= in.size() or in[i++] != '{') return false;
+            ws();
+            if(i < in.size() and in[i] == '}') return true;
+
+            while(i < in.size()) {
+                std::string key;
+                std::string value;
+
+                ws();
+                if(not string(key)) return false;
+                ws();
+                if(i >= in.size() or in[i++] != ':') return false;
+                ws();
+                if(i >= in.size()) return false;
+
+                if(in[i] == '"') {
+                    if(not string(value)) return false;
+                }
+                else {
+                    // nested value or literal, taken raw
+                    auto const b = i;
+                    int depth = 0;
+                    bool quoted = false;
+                    for(; i < in.size(); ++i) {
+                        auto c = in[i];
+                        if(quoted) {
+                            if(c == '\\') ++i;
+                            else if(c == '"') quoted = false;
+                            continue;
+                        }
+                        if(c == '"') quoted = true;
+                        else if(c == '{' or c == '[') ++depth;
+                        else if(c == '}' or c == ']') { if(depth == 0) break; --depth; }
+                        else if(c == ',' and depth == 0) break;
+                    }
+                    value.assign(in.substr(b, i - b));
+                    while(not value.empty() and isspace(static_cast<unsigned char>(value.back()))) value.pop_back();
+                }
+                out.emplace_back(std::move(key), std::move(value));
+
+                ws();
+                if(i >= in.size()) return false;
+                if(in[i] == '}') return true;
+                if(in[i++] != ',') return false;
+            }
+            return false;
+        }
+    }
+
+/**
+ * HMAC with key prepared once: every signature starts from copy of keyed context,
+ * so the key isn't hashed again per request. OpenSSL picks SHA-NI/AVX2 implementation by itself.
+ */
+    class Hmac {
+    public:
+        Hmac(std::string_view key, const char* digest) {
+            mac_ = EVP_MAC_fetch(nullptr, "HMAC", nullptr);
+            if(not mac_) return;
+
+            ctx_ = EVP_MAC_CTX_new(mac_);
+            OSSL_PARAM params[] = {
+                    OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>(digest), 0),
+                    OSSL_PARAM_construct_end()
+            };
+            if(not ctx_ or EVP_MAC_init(ctx_, reinterpret_cast<const unsigned char*>(key.data()), key.size(), params) != 1) {
+                EVP_MAC_CTX_free(ctx_);
+                ctx_ = nullptr;
+            }
+        }
+        Hmac(Hmac const&) = delete;
+        Hmac& operator=(Hmac const&) = delete;
+        ~Hmac() {
+            EVP_MAC_CTX_free(ctx_);
+            EVP_MAC_free(mac_);
+        }
+
+        bool valid() const { return ctx_ != nullptr; }
+
+        /**
+         * Constant time check of signature over data.
+         */
+        bool verify(std::string_view data, std::string_view signature) const {
+            if(not ctx_) return false;
+
+            auto* ctx = EVP_MAC_CTX_dup(ctx_);
+            if(not ctx) return false;
+
+            unsigned char out[EVP_MAX_MD_SIZE];
+            size_t len = 0;
+            bool const ok = EVP_MAC_update(ctx, reinterpret_cast<const unsigned char*>(data.data()), data.size()) == 1
+                            and EVP_MAC_final(ctx, out, &len, sizeof(out)) == 1;
+            EVP_MAC_CTX_free(ctx);
+
+            return ok and len == signature.size() and CRYPTO_memcmp(out, signature.data(), len) == 0;
+        }
+
+    private:
+        EVP_MAC* mac_ = nullptr;
+        EVP_MAC_CTX* ctx_ = nullptr;
+    };
+
+/**
+ * Sharded LRU of established identities keyed by salted credential digest. Shard is picked
+ * by key hash, so concurrent lookups rarely meet on the same lock. Entries are dropped at their expiry.
+ */
+    class IdentityCache {
+    public:
+        using clock_t = std::chrono::steady_clock;
+
+        IdentityCache(size_t shards, size_t entries_per_shard)
+            : shards_(std::max<size_t>(shards, 1)), entries_per_shard_(entries_per_shard) {}
+
+        std::shared_ptr<Identity const> get(std::string_view key, clock_t::time_point now = clock_t::now()) {
+            auto& shard = shard_of(key);
+            auto l_ = std::lock_guard(shard.lock);
+
+            auto it = shard.index.find(key);
+            if(it == shard.index.end()) return nullptr;
+
+            auto entry = it->second;
+            if(entry->expires <= now) {
+                shard.index.erase(it);
+                shard.lru.erase(entry);
+                return nullptr;
+            }
+            shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+            return entry->identity;
+        }
+
+        void put(std::string_view key, std::shared_ptr<Identity const> identity, clock_t::time_point expires) {
+            auto& shard = shard_of(key);
+            auto l_ = std::lock_guard(shard.lock);
+
+            // verified concurrently by someone else
+            if(shard.index.find(key) != shard.index.end()) return;
+
+            shard.lru.push_front({ std::string(key), std::move(identity), expires });
+            shard.index.emplace(shard.lru.front().key, shard.lru.begin());
+
+            while(shard.lru.size() > entries_per_shard_) {
+                shard.index.erase(shard.lru.back().key);
+                shard.lru.pop_back();
+            }
+        }
+
+        void clear() {
+            for(auto& shard: shards_) {
+                auto l_ = std::lock_guard(shard.lock);
+                shard.index.clear();
+                shard.lru.clear();
+            }
+        }
+
+    private:
+        struct Cached {
+            std::string key;
+            std::shared_ptr<Identity const> identity;
+            clock_t::time_point expires;
+        };
+
+        struct Shard {
+            std::mutex lock;
+            std::list<Cached> lru;
+            std::unordered_map<std::string_view, std::list<Cached>::iterator> index;    // keys point into lru
+        };
+
+        Shard& shard_of(std::string_view key) { return shards_[fnv1a(key) % shards_.size()]; }
+
+        std::vector<Shard> shards_;
+        size_t entries_per_shard_;
+    };
+
+/**
+ * Bearer token (JWT signed with HMAC) authentication. Verified tokens are kept in sharded LRU, keyed by their
+ * salted SHA-256 digest, until their expiry or max_ttl, so signature and claims are checked once per token,
+ * not per request.
+ * Claims of the token are claims of Identity, "sub" is its subject.
+ */
+    class TokenAuthenticator: public Authenticator {
+    public:
+        struct options_t {
+            std::string secret;
+            std::string algorithm = "HS256";                // HS256, HS384 or HS512
+            std::string issuer;                             // required "iss" if not empty
+            std::string audience;                           // required "aud" if not empty
+
+            std::chrono::seconds max_ttl { 300 };           // cache bound for tokens without "exp"
+            std::chrono::seconds leeway { 30 };             // clock skew for "exp" and "nbf"
+
+            size_t shards = 16;
+            size_t entries_per_shard = 1024;
+        };
+
+        struct stats_t {
+            std::atomic<uint64_t> hits { 0 };
+            std::atomic<uint64_t> verified { 0 };
+            std::atomic<uint64_t> rejected { 0 };
+        };
+
+        explicit TokenAuthenticator(options_t o)
+            : options_(std::move(o)),
+              hmac_(options_.secret, digest(options_.algorithm)),
+              cache_(options_.shards, options_.entries_per_shard) {
+            RAND_bytes(salt_, sizeof(salt_));
+        }
+
+        options_t const& options() const { return options_; }
+        stats_t const& stats() const { return stats_; }
+
+        std::shared_ptr<Identity const> authenticate(struct MHD_Connection* connection) override {
+            auto const* hdr = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_AUTHORIZATION);
+            if(not hdr or strncasecmp(hdr, "Bearer ", 7) != 0) return nullptr;
+
+            std::string_view token(hdr + 7);
+            while(not token.empty() and token.front() == ' ') token.remove_prefix(1);
+
+            return authenticate(token);
+        }
+
+        std::shared_ptr<Identity const> authenticate(std::string_view token) {
+            if(token.empty()) return nullptr;
+
+            // live tokens are not kept in memory, only their digests
+            auto const key = token_key(token);
+            auto const now = clock_t::now();
+            if(auto cached = cache_.get(key, now); cached) {
+                ++stats_.hits;
+                return cached;
+            }
+
+            // verified outside of the lock, same token verified twice concurrently is harmless
+            clock_t::time_point expires;
+            auto identity = verify(token, now, expires);
+            if(not identity) {
+                ++stats_.rejected;
+                return nullptr;
+            }
+            ++stats_.verified;
+
+            cache_.put(key, identity, expires);
+            return identity;
+        }
+
+        int reject(struct MHD_Connection* connection) override {
+            auto* response = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+            MHD_add_response_header(response, MHD_HTTP_HEADER_WWW_AUTHENTICATE, "Bearer");
+            auto ret = MHD_queue_response(connection, MHD_HTTP_UNAUTHORIZED, response);
+            MHD_destroy_response(response);
+            return ret;
+        }
+
+        void clear() { cache_.clear(); }
+
+    private:
+        using clock_t = IdentityCache::clock_t;
+
+        static const char* digest(std::string const& alg) {
+            if(alg == "HS384") return "SHA384";
+            if(alg == "HS512") return "SHA512";
+            return "SHA256";
+        }
+
+        std::string token_key(std::string_view token) const {
+            unsigned char md[EVP_MAX_MD_SIZE];
+            unsigned int len = 0;
+
+            auto* ctx = EVP_MD_CTX_new();
+            EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+            EVP_DigestUpdate(ctx, salt_, sizeof(salt_));
+            EVP_DigestUpdate(ctx, token.data(), token.size());
+            EVP_DigestFinal_ex(ctx, md, &len);
+            EVP_MD_CTX_free(ctx);
+
+            return { reinterpret_cast<const char*>(md), len };
+        }
+
+        std::shared_ptr<Identity const> verify(std::string_view token, clock_t::time_point now, clock_t::time_point& expires) const {
+            auto const d1 = token.find('.');
+            auto const d2 = d1 == std::string_view::npos ? d1 : token.find('.', d1 + 1);
+            if(d2 == std::string_view::npos) return nullptr;
+
+            std::string header;
+            std::string payload;
+            std::string signature;
+            if(not detail::base64url_decode(token.substr(0, d1), header)
+               or not detail::base64url_decode(token.substr(d1 + 1, d2 - d1 - 1), payload)
+               or not detail::base64url_decode(token.substr(d2 + 1), signature))
+                return nullptr;
+
+            // algorithm is ours, not the one token asks for
+            std::vector<std::pair<std::string, std::string>> hdr;
+            if(not detail::parse_json_object(header, hdr)) return nullptr;
+            auto const alg = std::find_if(hdr.begin(), hdr.end(), [](auto const& p) { return p.first == "alg"; });
+            if(alg == hdr.end() or alg->second != options_.algorithm) return nullptr;
+
+            if(not hmac_.verify(token.substr(0, d2), signature)) return nullptr;
+
+            auto identity = std::make_shared<Identity>();
+            identity->scheme = "bearer";
+            if(not detail::parse_json_object(payload, identity->claims)) return nullptr;
+
+            auto const wall = std::chrono::system_clock::now();
+            auto const unix_now = std::chrono::duration_cast<std::chrono::seconds>(wall.time_since_epoch()).count();
+            auto const leeway = options_.leeway.count();
+
+            expires = now + options_.max_ttl;
+            if(auto exp = identity->claim("exp"); not exp.empty()) {
+                auto const e = std::strtoll(std::string(exp).c_str(), nullptr, 10);
+                if(e + leeway <= unix_now) return nullptr;
+                expires = std::min(expires, now + std::chrono::seconds(e + leeway - unix_now));
+            }
+            if(auto nbf = identity->claim("nbf"); not nbf.empty()) {
+                if(std::strtoll(std::string(nbf).c_str(), nullptr, 10) > unix_now + leeway) return nullptr;
+            }
+            if(not options_.issuer.empty() and identity->claim("iss") != options_.issuer) return nullptr;
+            if(not options_.audience.empty()) {
+                // single audience or array of them
+                auto const aud = identity->claim("aud");
+                if(aud != options_.audience and aud.find("\"" + options_.audience + "\"") == std::string_view::npos)
+                    return nullptr;
+            }
+
+            identity->subject = identity->claim("sub");
+            return identity;
+        }
+
+        options_t options_;
+        stats_t stats_;
+        Hmac hmac_;
+        IdentityCache cache_;
+        unsigned char salt_[16] = {};
+    };
+
+/**
+ * HTTP Basic authentication through libmicrohttpd helpers. Password check (verifier) is expected to be expensive
+ * (argon2, bcrypt), so accepted credentials are cached for ttl, keyed by their salted SHA-256 digest -
+ * keep-alive clients repeating the same Authorization header are verified once.
+ */
+    class BasicAuthenticator: public Authenticator {
+    public:
+        using verifier_t = std::function<bool(std::string const& user, std::string const& password)>;
+
+        struct options_t {
+            std::string realm = "lmhttpd";
+            std::chrono::seconds ttl { 300 };
+            size_t shards = 16;
+            size_t entries_per_shard = 1024;
+        };
+
+        explicit BasicAuthenticator(verifier_t verifier) : BasicAuthenticator(std::move(verifier), options_t()) {}
+        BasicAuthenticator(verifier_t verifier, options_t o)
+            : verifier_(std::move(verifier)), options_(std::move(o)), cache_(options_.shards, options_.entries_per_shard) {
+            RAND_bytes(salt_, sizeof(salt_));
+        }
+
+        std::shared_ptr<Identity const> authenticate(struct MHD_Connection* connection) override {
+            char* password = nullptr;
+            char* user = MHD_basic_auth_get_username_password(connection, &password);
+            if(not user) {
+                if(password) MHD_free(password);
+                return nullptr;
+            }
+
+            std::string const u(user);
+            std::string p(password ? password : "");
+            MHD_free(user);
+            if(password) {
+                OPENSSL_cleanse(password, p.size());
+                MHD_free(password);
+            }
+
+            auto identity = authenticate(u, p);
+            OPENSSL_cleanse(p.data(), p.size());
+            return identity;
+        }
+
+        std::shared_ptr<Identity const> authenticate(std::string const& user, std::string const& password) {
+            auto const key = credential_key(user, password);
+            auto const now = IdentityCache::clock_t::now();
+
+            if(auto cached = cache_.get(key, now); cached) return cached;
+            if(not verifier_ or not verifier_(user, password)) return nullptr;
+
+            auto identity = std::make_shared<Identity>();
+            identity->scheme = "basic";
+            identity->subject = user;
+
+            cache_.put(key, identity, now + options_.ttl);
+            return identity;
+        }
+
+        int reject(struct MHD_Connection* connection) override {
+            auto* response = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+            auto ret = MHD_queue_basic_auth_fail_response(connection, options_.realm.c_str(), response);
+            MHD_destroy_response(response);
+            return ret;
+        }
+
+        // password changed or user removed
+        void clear() { cache_.clear(); }
+
+    private:
+        std::string credential_key(std::string const& user, std::string const& password) const {
+            unsigned char md[EVP_MAX_MD_SIZE];
+            unsigned int len = 0;
+
+            auto* ctx = EVP_MD_CTX_new();
+            EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+            EVP_DigestUpdate(ctx, salt_, sizeof(salt_));
+            EVP_DigestUpdate(ctx, user.data(), user.size() + 1);    // with NUL, separates user from password
+            EVP_DigestUpdate(ctx, password.data(), password.size());
+            EVP_DigestFinal_ex(ctx, md, &len);
+            EVP_MD_CTX_free(ctx);
+
+            return { reinterpret_cast<const char*>(md), len };
+        }
+
+        verifier_t verifier_;
+        options_t options_;
+        IdentityCache cache_;
+        unsigned char salt_[16] = {};
+    };
+
+/**
+ * HTTP Digest authentication through libmicrohttpd helpers. WebServer needs options_t::digest_auth set,
+ * so the daemon has nonce secret. Digest itself is cheap and nonce makes every request different, so what's
+ * cached is the password lookup (typically a database or vault call) per user, for ttl.
+ */
+    class DigestAuthenticator: public Authenticator {
+    public:
+        // password of user, nullopt if there is no such user
+        using lookup_t = std::function<std::optional<std::string>(std::string const& user)>;
+
+        struct options_t {
+            std::string realm = "lmhttpd";
+            std::string opaque;                             // random if empty
+            unsigned int nonce_timeout = 300;
+            MHD_DigestAuthAlgorithm algorithm = MHD_DIGEST_ALG_SHA256;
+            std::chrono::seconds ttl { 300 };
+        };
+
+        explicit DigestAuthenticator(lookup_t lookup) : DigestAuthenticator(std::move(lookup), options_t()) {}
+        DigestAuthenticator(lookup_t lookup, options_t o) : lookup_(std::move(lookup)), options_(std::move(o)) {
+            if(options_.opaque.empty()) {
+                unsigned char r[16];
+                RAND_bytes(r, sizeof(r));
+                for(auto b: r) {
+                    constexpr const char* hex = "0123456789abcdef";
+                    options_.opaque += hex[b >> 4];
+                    options_.opaque += hex[b & 0xf];
+                }
+            }
+        }
+
+        std::shared_ptr<Identity const> authenticate(struct MHD_Connection* connection) override {
+            // flag is per request, previous one on this connection must not set it
+            auto* ctx = ConnectionContext::of(connection);
+            if(ctx) ctx->stale_nonce = false;
+
+            char* user = MHD_digest_auth_get_username(connection);
+            if(not user) return nullptr;
+            std::string const u(user);
+            MHD_free(user);
+
+            auto const account = find(u);
+            if(not account) return nullptr;
+
+            auto const ret = MHD_digest_auth_check2(connection, options_.realm.c_str(), u.c_str(), account->password.c_str(),
+                                                    options_.nonce_timeout, options_.algorithm);
+            if(ret == MHD_YES) return account->identity;
+
+            // nonce refused (expired or unknown): only picks signal_stale of the fail response reject() queues
+            // for this request, password isn't known to be right
+            if(ctx) ctx->stale_nonce = ret == MHD_INVALID_NONCE;
+            return nullptr;
+        }
+
+        int reject(struct MHD_Connection* connection) override {
+            auto const* ctx = ConnectionContext::of(connection);
+            bool const stale = ctx and ctx->stale_nonce;
+
+            auto* response = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+            auto ret = MHD_queue_auth_fail_response2(connection, options_.realm.c_str(), options_.opaque.c_str(), response,
+                                                     stale ? MHD_YES : MHD_NO, options_.algorithm);
+            MHD_destroy_response(response);
+            return ret;
+        }
+
+        void clear() {
+            auto l_ = std::lock_guard(lock_);
+            accounts_.clear();
+        }
+
+    private:
+        struct account_t {
+            std::string password;
+            std::shared_ptr<Identity const> identity;
+            IdentityCache::clock_t::time_point expires;
+        };
+
+        std::shared_ptr<account_t const> find(std::string const& user) {
+            auto const now = IdentityCache::clock_t::now();
+            {
+                auto l_ = std::lock_guard(lock_);
+                auto it = accounts_.find(user);
+                if(it != accounts_.end() and it->second->expires > now) return it->second;
+            }
+
+            auto password = lookup_ ? lookup_(user) : std::nullopt;
+            if(not password) return nullptr;
+
+            auto identity = std::make_shared<Identity>();
+            identity->scheme = "digest";
+            identity->subject = user;
+
+            auto account = std::make_shared<account_t const>(account_t { std::move(*password), std::move(identity), now + options_.ttl });
+
+            auto l_ = std::lock_guard(lock_);
+            accounts_[user] = account;
+            return account;
+        }
+
+        lookup_t lookup_;
+        options_t options_;
+
+        std::mutex lock_;
+        std::unordered_map<std::string, std::shared_ptr<account_t const>> accounts_;
+    };
+}
+#endif //LMHTTPD_AUTH_HPP
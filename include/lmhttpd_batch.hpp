@@ -0,0 +1,447 @@
+/*
+ *
+Copyright (c) 2021, Ales Stibal <astib@mag0.net>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+        modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+        IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+        FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+        DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+        SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+        CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#ifndef LMHTTPD_BATCH_HPP
+#define LMHTTPD_BATCH_HPP
+
+#include <lmhttpd.hpp>
+
+#include <atomic>
+
+namespace lmh {
+
+/**
+ * Runs many sub-requests sent in one HTTP call, through the same router and DynamicController handlers.
+ *
+ * Request and response bodies are multipart/mixed, each part is application/http message:
+ *
+ *   --batch
+ *   Content-Type: application/http
+ *   Content-ID: 1
+ *
+ *   GET /users/me HTTP/1.1
+ *
+ *   --batch--
+ *
+ * Response parts are in request order and carry the same Content-ID. Handlers see headers of the batch request,
+ * headers of sub-requests are not passed to them. Query arguments of sub-request are seen by request_argument(),
+ * not by MHD_lookup_connection_value(). Routes of other than DynamicController handlers get 501 part. Each
+ * sub-request is authenticated (with batch request headers) and admitted by the bulkhead of its route like a
+ * request of its own, refused one gets 401/403 or 503 part. Sub-requests of concurrent() controllers run in
+ * parallel on server workers (the batch connection is suspended meanwhile), the rest runs on libmicrohttpd
+ * thread.
+ */
+    class BatchController: public Controller {
+    public:
+        static inline size_t max_body = 1024 * 1024;
+        static inline size_t max_requests = 64;
+
+        explicit BatchController(WebServer& server, std::string path = "/batch")
+            : server_(server), path_(std::move(path)) {}
+
+        MethodSet methods() const override { return Method::POST; }
+
+        // batch connection waits suspended for sub-requests running on server workers
+        bool suspends() const override { return server_.workers() or server_.options().worker_threads > 0; }
+
+        bool validRoute(const char* path, Method) override {
+            return path_ == path;
+        }
+
+        int handleRequest(struct MHD_Connection* connection,
+                          const char* url, const char* method, const char* upload_data,
+                          size_t* upload_data_size, void** ptr) override {
+
+            if(not *ptr) {
+                auto* created = new BatchState(*this);
+                created->method = Method::POST;
+                *ptr = created;
+                return MHD_YES;
+            }
+
+            auto* state = static_cast<BatchState*>(*ptr);
+
+            // collect body
+            if(*upload_data_size > 0) {
+                if(state->request_data.size() + *upload_data_size > max_body) return MHD_NO;
+
+                state->request_data.append(upload_data, *upload_data_size);
+                *upload_data_size = 0;
+                return MHD_YES;
+            }
+
+            if(state->response_sent) return MHD_YES;
+
+            if(not state->job) {
+                state->job = std::make_shared<Job>();
+                if(not parse(connection, state->request_data, *state->job)) {
+                    state->response_sent = true;
+                    return queue_empty(connection, MHD_HTTP_BAD_REQUEST);
+                }
+
+                if(start(connection, state->job)) {
+                    // suspended, we will be called again when resumed
+                    return MHD_YES;
+                }
+            }
+
+            {
+                auto l_ = std::lock_guard(state->job->lock);
+                if(state->job->pending > 0) return MHD_YES;
+            }
+
+            auto* response = build_response(*state->job);
+            if(not response) return MHD_NO;
+
+            auto ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+            MHD_destroy_response(response);
+            if(ret == MHD_YES) state->response_sent = true;
+            return ret;
+        }
+
+        int handleComplete(struct MHD_Connection* connection, enum MHD_RequestTerminationCode toe, ConnectionState* cs) override {
+            // on abort or shutdown workers skip sub-requests not started yet, wait for running ones using connection
+            if(auto* state = dynamic_cast<BatchState*>(cs); state and state->job) {
+                auto l_ = std::unique_lock(state->job->lock);
+                state->job->cancelled = true;
+                state->job->idle.wait(l_, [&]() { return state->job->running == 0; });
+            }
+            return Controller::handleComplete(connection, toe, cs);
+        }
+
+    private:
+        struct SubRequest {
+            std::string content_id;
+            Method method = Method::UNKNOWN;
+            std::string method_str;
+            std::string path;
+            std::string body;
+
+            RequestPart part;
+            WebServer::Dispatch dispatch;
+            unsigned int status = MHD_HTTP_OK;
+            std::vector<std::pair<std::string, std::string>> headers;
+            std::string response;
+        };
+
+        struct Job {
+            std::vector<SubRequest> requests;
+            std::string boundary;
+
+            std::mutex lock;
+            std::condition_variable idle;
+            size_t pending = 0;
+            size_t running = 0;         // sub-requests executing on workers, using the connection
+            bool cancelled = false;     // batch request is gone, connection must not be used
+        };
+
+        struct BatchState: public ConnectionState {
+            using ConnectionState::ConnectionState;
+            std::shared_ptr<Job> job;
+        };
+
+        static int queue_empty(struct MHD_Connection* connection, unsigned int status) {
+            auto* response = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+            auto ret = MHD_queue_response(connection, status, response);
+            MHD_destroy_response(response);
+            return ret;
+        }
+
+        static std::string_view trim(std::string_view s) {
+            while(not s.empty() and (s.front() == ' ' or s.front() == '\t')) s.remove_prefix(1);
+            while(not s.empty() and (s.back() == ' ' or s.back() == '\t' or s.back() == '\r')) s.remove_suffix(1);
+            return s;
+        }
+
+        static bool iequals(std::string_view a, std::string_view b) {
+            return a.size() == b.size() and std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+                return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+            });
+        }
+
+        static int hex_digit(char c) {
+            if(c >= '0' and c <= '9') return c - '0';
+            if(c >= 'a' and c <= 'f') return c - 'a' + 10;
+            if(c >= 'A' and c <= 'F') return c - 'A' + 10;
+            return -1;
+        }
+
+        // percent and '+' decoding, as libmicrohttpd does for query arguments
+        static std::string unescape(std::string_view s) {
+            std::string out;
+            out.reserve(s.size());
+            for(size_t i = 0; i < s.size(); ++i) {
+                if(s[i] == '+') {
+                    out.push_back(' ');
+                }
+                else if(s[i] == '%' and i + 2 < s.size() and hex_digit(s[i + 1]) >= 0 and hex_digit(s[i + 2]) >= 0) {
+                    out.push_back(static_cast<char>(hex_digit(s[i + 1]) * 16 + hex_digit(s[i + 2])));
+                    i += 2;
+                }
+                else {
+                    out.push_back(s[i]);
+                }
+            }
+            return out;
+        }
+
+        static void parse_query(std::string_view query, std::vector<std::pair<std::string, std::string>>& arguments) {
+            while(not query.empty()) {
+                auto const amp = query.find('&');
+                auto const arg = query.substr(0, amp);
+                query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+                if(arg.empty()) continue;
+
+                auto const eq = arg.find('=');
+                arguments.emplace_back(unescape(arg.substr(0, eq)),
+                                       eq == std::string_view::npos ? std::string() : unescape(arg.substr(eq + 1)));
+            }
+        }
+
+        // splits "header block CRLF CRLF rest", returns header lines and rest
+        static bool split_message(std::string_view msg, std::vector<std::string_view>& lines, std::string_view& rest) {
+            auto const end = msg.find("\r\n\r\n");
+            auto head = end == std::string_view::npos ? msg : msg.substr(0, end);
+            rest = end == std::string_view::npos ? std::string_view() : msg.substr(end + 4);
+
+            while(not head.empty()) {
+                auto const eol = head.find("\r\n");
+                lines.push_back(head.substr(0, eol));
+                if(eol == std::string_view::npos) break;
+                head.remove_prefix(eol + 2);
+            }
+            return not lines.empty();
+        }
+
+        static bool parse(struct MHD_Connection* connection, std::string_view body, Job& job) {
+            auto const* ct = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_CONTENT_TYPE);
+            if(not ct) return false;
+
+            std::string_view ctv(ct);
+            auto const b = ctv.find("boundary=");
+            if(b == std::string_view::npos) return false;
+
+            auto boundary = ctv.substr(b + 9);
+            boundary = boundary.substr(0, boundary.find(';'));
+            boundary = trim(boundary);
+            if(boundary.size() >= 2 and boundary.front() == '"' and boundary.back() == '"')
+                boundary = boundary.substr(1, boundary.size() - 2);
+            if(boundary.empty()) return false;
+
+            auto const delimiter = "--" + std::string(boundary);
+            job.boundary = "lmh_" + std::string(boundary);
+
+            auto pos = body.find(delimiter);
+            while(pos != std::string_view::npos) {
+                pos += delimiter.size();
+                if(body.compare(pos, 2, "--") == 0) return not job.requests.empty();
+
+                auto const next = body.find("\r\n" + delimiter, pos);
+                if(next == std::string_view::npos) return false;
+
+                auto part = body.substr(pos, next - pos);
+                if(part.compare(0, 2, "\r\n") == 0) part.remove_prefix(2);
+                pos = next + 2;
+
+                if(job.requests.size() >= max_requests) return false;
+
+                // part headers, then embedded http request
+                std::vector<std::string_view> part_headers;
+                std::string_view msg;
+                if(not split_message(part, part_headers, msg)) return false;
+
+                SubRequest sub;
+                for(auto const& h: part_headers) {
+                    auto const colon = h.find(':');
+                    if(colon != std::string_view::npos and iequals(trim(h.substr(0, colon)), "Content-ID"))
+                        sub.content_id = trim(h.substr(colon + 1));
+                }
+
+                std::vector<std::string_view> req_lines;
+                std::string_view req_body;
+                if(not split_message(msg, req_lines, req_body)) return false;
+
+                // request line: METHOD path HTTP/1.1
+                auto const& rl = req_lines.front();
+                auto const sp1 = rl.find(' ');
+                auto const sp2 = rl.find(' ', sp1 + 1);
+                if(sp1 == std::string_view::npos) return false;
+
+                sub.method_str = rl.substr(0, sp1);
+
+                // routes and handlers get the path, like from libmicrohttpd
+                auto const target = rl.substr(sp1 + 1, sp2 == std::string_view::npos ? std::string_view::npos : sp2 - sp1 - 1);
+                auto const q = target.find('?');
+                sub.path = target.substr(0, q);
+                if(q != std::string_view::npos) parse_query(target.substr(q + 1), sub.part.arguments);
+                sub.method = parse_method(sub.method_str.c_str());
+                sub.body = req_body;
+
+                job.requests.emplace_back(std::move(sub));
+            }
+            return false;
+        }
+
+        // status of sub-request refused by dispatch()
+        static unsigned int refused_status(WebServer::Dispatch const& d) {
+            switch(d.verdict) {
+                case WebServer::Dispatch::UNAUTHORIZED:
+                    return d.authenticator->reject_status();
+                case WebServer::Dispatch::QUEUED:
+                case WebServer::Dispatch::UNAVAILABLE:
+                    return MHD_HTTP_SERVICE_UNAVAILABLE;
+                default:
+                    return MHD_HTTP_NOT_FOUND;
+            }
+        }
+
+        // runs one dispatched sub-request by calling createResponse() of its controller, gives back its bulkhead slot
+        void execute(struct MHD_Connection* connection, SubRequest& sub) const {
+            PartScope scope(sub.part);
+            run(connection, sub);
+            WebServer::release_slot(sub.dispatch.slot);
+        }
+
+        void run(struct MHD_Connection* connection, SubRequest& sub) const {
+            auto* dc = dynamic_cast<DynamicController*>(sub.dispatch.controller);
+            if(not dc) {
+                sub.status = MHD_HTTP_NOT_IMPLEMENTED;
+                return;
+            }
+
+            std::unique_ptr<ConnectionState> state(dc->create_state());
+            state->method = sub.method;
+            void* sub_ptr = state.get();
+
+            std::stringstream ss;
+            size_t upload_size = sub.body.size();
+            auto const params = dc->createResponse(connection, sub.path.c_str(), sub.method_str.c_str(),
+                                                   sub.body.empty() ? nullptr : sub.body.data(), &upload_size,
+                                                   &sub_ptr, ss);
+            if(params.response_code == MHD_NO) {
+                sub.status = MHD_HTTP_INTERNAL_SERVER_ERROR;
+                return;
+            }
+
+            sub.response = ss.str();
+            for(auto const& seg: state->response_body.segments) sub.response.append(seg);
+            sub.headers = params.headers;
+        }
+
+        // returns true if connection was suspended for workers
+        bool start(struct MHD_Connection* connection, std::shared_ptr<Job> const& job) const {
+            auto const& workers = server_.workers();
+
+            std::vector<SubRequest*> offloaded;
+            for(auto& sub: job->requests) {
+                // routing, authentication and admission stay on libmicrohttpd thread, like for any request
+                sub.dispatch = server_.dispatch(connection, sub.path.c_str(), sub.method, sub.method_str.c_str(), true);
+                if(sub.dispatch.verdict != WebServer::Dispatch::RUN) {
+                    sub.status = refused_status(sub.dispatch);
+                    continue;
+                }
+                sub.part.identity = sub.dispatch.identity;
+
+                auto const* dc = dynamic_cast<DynamicController const*>(sub.dispatch.controller);
+
+                if(workers and dc and dc->concurrent())
+                    offloaded.push_back(&sub);
+                else
+                    execute(connection, sub);
+            }
+
+            if(offloaded.empty()) return false;
+
+            job->pending = offloaded.size();
+            suspend_connection(connection);
+
+            for(auto* sub: offloaded) {
+                // job is shared with workers, it outlives cancelled batch request
+                workers->submit([this, connection, job, sub]() {
+                    bool cancelled;
+                    {
+                        auto l_ = std::lock_guard(job->lock);
+                        cancelled = job->cancelled;
+                        if(not cancelled) ++job->running;
+                    }
+                    if(cancelled)
+                        WebServer::release_slot(sub->dispatch.slot);
+                    else
+                        execute(connection, *sub);
+
+                    {
+                        auto l_ = std::lock_guard(job->lock);
+                        if(not cancelled) --job->running;
+                        if(--job->pending == 0 and not job->cancelled) resume_connection(connection);
+                    }
+                    job->idle.notify_all();
+                }, priority());
+            }
+            return true;
+        }
+
+        static MHD_Response* build_response(Job const& job) {
+            // sub-responses are moved into owned segments, static parts are persistent
+            ResponseBody body;
+            auto const delimiter = "--" + job.boundary;
+
+            for(auto const& sub: job.requests) {
+                std::stringstream head;
+                head << delimiter << "\r\n"
+                     << "Content-Type: application/http\r\n";
+                if(not sub.content_id.empty())
+                    head << "Content-ID: " << sub.content_id << "\r\n";
+                head << "\r\n"
+                     << "HTTP/1.1 " << sub.status << " \r\n";
+                for(auto const& [hdr, val]: sub.headers)
+                    head << hdr << ": " << val << "\r\n";
+                head << "Content-Length: " << sub.response.size() << "\r\n\r\n";
+
+                body.add_owned(head.str());
+                body.add_owned(sub.response);
+                body.add_persistent("\r\n");
+            }
+            body.add_owned(delimiter + "--\r\n");
+
+            auto* response = body.create_response();
+            if(response) {
+                auto const ct = "multipart/mixed; boundary=" + job.boundary;
+                MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, ct.c_str());
+            }
+            return response;
+        }
+
+        WebServer& server_;
+        std::string path_;
+    };
+}
+#endif //LMHTTPD_BATCH_HPP
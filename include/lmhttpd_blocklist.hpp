@@ -0,0 +1,341 @@
+/*
+ *
+Copyright (c) 2021, Ales Stibal <astib@mag0.net>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+        modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+        IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+        FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+        DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+        SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+        CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#ifndef LMHTTPD_BLOCKLIST_HPP
+#define LMHTTPD_BLOCKLIST_HPP
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <lmhttpd.hpp>
+
+#include <atomic>
+#include <istream>
+#include <memory>
+
+namespace lmh {
+
+/**
+ * Compiled set of IPv4 and IPv6 prefixes, Poptrie style: first 16 bits of address index direct table,
+ * the rest is walked 6 bits per level through nodes with two bitmaps - which of 64 children are nodes,
+ * which are blocked leaves. Children of a node are stored together, child is found by popcount.
+ *
+ * IPv4 lookup is at most 4 memory accesses, IPv6 one grows with prefix length (/48 is 7).
+ * Table is immutable, built once by IpBlocklist::Builder.
+ */
+    class IpPrefixTable {
+    public:
+        using key_t = unsigned __int128;    // address left-aligned, IPv4 in top 32 bits
+
+        bool contains_v4(uint32_t addr) const { return contains(v4_, static_cast<key_t>(addr) << 96); }
+        bool contains_v6(key_t addr) const { return contains(v6_, addr); }
+
+        size_t prefixes() const { return prefixes_; }
+        size_t nodes() const { return v4_.nodes.size() + v6_.nodes.size(); }
+
+    private:
+        friend class IpBlocklist;
+
+        static constexpr unsigned top_bits = 16;
+        static constexpr unsigned stride = 6;
+
+        struct Node {
+            uint64_t vector = 0;       // child is node
+            uint64_t leafvec = 0;      // child is blocked leaf
+            uint32_t base = 0;         // index of first child node
+        };
+
+        struct Prefix {
+            key_t addr;
+            unsigned len;
+        };
+
+        struct Trie {
+            // 0 not blocked, 1 blocked, n + 2 is node n
+            std::vector<uint32_t> top;
+            std::vector<Node> nodes;
+        };
+
+        static unsigned chunk(key_t key, unsigned depth) {
+            return depth + stride <= 128 ? static_cast<unsigned>(key >> (128 - depth - stride)) & 63
+                                         : static_cast<unsigned>(key << (depth + stride - 128)) & 63;
+        }
+
+        static bool contains(Trie const& t, key_t key) {
+            if(t.top.empty()) return false;
+
+            auto const top = t.top[static_cast<size_t>(key >> (128 - top_bits))];
+            if(top < 2) return top == 1;
+
+            auto const* node = &t.nodes[top - 2];
+            for(unsigned depth = top_bits; ; depth += stride) {
+                auto const bit = uint64_t(1) << chunk(key, depth);
+                if(not (node->vector & bit)) return node->leafvec & bit;
+
+                node = &t.nodes[node->base + __builtin_popcountll(node->vector & (bit - 1))];
+            }
+        }
+
+        // prefixes are sorted and none contains another
+        static void build(Trie& t, std::vector<Prefix> const& prefixes) {
+            if(prefixes.empty()) return;
+            t.top.assign(size_t(1) << top_bits, 0);
+
+            for(size_t b = 0; b < prefixes.size(); ) {
+                auto const& p = prefixes[b];
+                auto const slot = static_cast<size_t>(p.addr >> (128 - top_bits));
+
+                if(p.len <= top_bits) {
+                    auto const span = size_t(1) << (top_bits - p.len);
+                    std::fill_n(t.top.begin() + slot, span, 1);
+                    ++b;
+                    continue;
+                }
+
+                auto e = b;
+                while(e < prefixes.size() and static_cast<size_t>(prefixes[e].addr >> (128 - top_bits)) == slot) ++e;
+
+                auto const at = t.nodes.size();
+                t.nodes.emplace_back();
+                fill(t, at, top_bits, prefixes, b, e);
+                t.top[slot] = static_cast<uint32_t>(at + 2);
+                b = e;
+            }
+        }
+
+        static void fill(Trie& t, size_t at, unsigned depth, std::vector<Prefix> const& prefixes, size_t b, size_t e) {
+            Node node;
+
+            // children groups: slot and range of prefixes inside it
+            std::vector<std::tuple<unsigned, size_t, size_t>> groups;
+            while(b < e) {
+                auto const& p = prefixes[b];
+                auto const slot = chunk(p.addr, depth);
+
+                if(p.len <= depth + stride) {
+                    auto const span = 1u << (depth + stride - p.len);
+                    for(unsigned s = slot; s < slot + span; ++s) node.leafvec |= uint64_t(1) << s;
+                    ++b;
+                    continue;
+                }
+
+                auto g = b;
+                while(g < e and chunk(prefixes[g].addr, depth) == slot) ++g;
+                node.vector |= uint64_t(1) << slot;
+                groups.emplace_back(slot, b, g);
+                b = g;
+            }
+
+            node.base = static_cast<uint32_t>(t.nodes.size());
+            t.nodes.resize(t.nodes.size() + groups.size());
+            t.nodes[at] = node;
+
+            for(size_t i = 0; i < groups.size(); ++i) {
+                auto const [slot, gb, ge] = groups[i];
+                fill(t, node.base + i, depth + stride, prefixes, gb, ge);
+            }
+        }
+
+        Trie v4_;
+        Trie v6_;
+        size_t prefixes_ = 0;
+    };
+
+/**
+ * Blocklist of addresses and prefixes for millions of entries (threat intelligence feeds).
+ * New table is compiled off the request path and swapped in atomically, lookups hold a reference
+ * to the table they use, so it's freed only after the last one of them is done.
+ *
+ * Meant for WebServer::options_t::accept_policy, it's checked before connection is set up:
+ *
+ *     server.options().accept_policy = IpBlocklist::policy(blocklist);
+ */
+    class IpBlocklist {
+    public:
+        /**
+         * Collects entries: "192.0.2.1", "198.51.100.0/24", "2001:db8::/32". Host bits of prefix are ignored.
+         */
+        class Builder {
+        public:
+            bool add(std::string_view entry) {
+                // trailing comment and whitespace
+                entry = entry.substr(0, entry.find('#'));
+                while(not entry.empty() and isspace(static_cast<unsigned char>(entry.back()))) entry.remove_suffix(1);
+                while(not entry.empty() and isspace(static_cast<unsigned char>(entry.front()))) entry.remove_prefix(1);
+                if(entry.empty()) return true;
+
+                std::string addr(entry.substr(0, entry.find('/')));
+                int len = -1;
+                if(auto slash = entry.find('/'); slash != std::string_view::npos) {
+                    auto const n = entry.substr(slash + 1);
+                    if(n.empty() or n.size() > 3 or not std::all_of(n.begin(), n.end(), [](unsigned char c) { return c >= '0' and c <= '9'; })) return reject();
+                    len = std::stoi(std::string(n));
+                }
+
+                in_addr a4{};
+                in6_addr a6{};
+                if(inet_pton(AF_INET, addr.c_str(), &a4) == 1) {
+                    if(len > 32) return reject();
+                    v4_.push_back(masked(static_cast<IpPrefixTable::key_t>(ntohl(a4.s_addr)) << 96, len < 0 ? 32 : len));
+                }
+                else if(inet_pton(AF_INET6, addr.c_str(), &a6) == 1) {
+                    if(len > 128) return reject();
+                    v6_.push_back(masked(to_key(a6), len < 0 ? 128 : len));
+                }
+                else return reject();
+
+                return true;
+            }
+
+            size_t add(std::istream& in) {
+                size_t added = 0;
+                std::string line;
+                while(std::getline(in, line)) {
+                    if(add(line)) ++added;
+                }
+                return added;
+            }
+
+            size_t rejected() const { return rejected_; }
+
+            std::shared_ptr<IpPrefixTable const> build() {
+                auto t = std::make_shared<IpPrefixTable>();
+                normalize(v4_);
+                normalize(v6_);
+                IpPrefixTable::build(t->v4_, v4_);
+                IpPrefixTable::build(t->v6_, v6_);
+                t->prefixes_ = v4_.size() + v6_.size();
+                return t;
+            }
+
+        private:
+            bool reject() {
+                ++rejected_;
+                return false;
+            }
+
+            static IpPrefixTable::Prefix masked(IpPrefixTable::key_t addr, int len) {
+                if(len == 0) return { 0, 0 };
+                auto const mask = ~IpPrefixTable::key_t(0) << (128 - len);
+                return { addr & mask, static_cast<unsigned>(len) };
+            }
+
+            // sort and drop prefixes covered by another one
+            static void normalize(std::vector<IpPrefixTable::Prefix>& v) {
+                std::sort(v.begin(), v.end(), [](auto const& a, auto const& b) {
+                    return a.addr != b.addr ? a.addr < b.addr : a.len < b.len;
+                });
+
+                size_t kept = 0;
+                for(size_t i = 0; i < v.size(); ++i) {
+                    if(kept) {
+                        auto const& last = v[kept - 1];
+                        auto const mask = last.len ? ~IpPrefixTable::key_t(0) << (128 - last.len) : 0;
+                        if((v[i].addr & mask) == last.addr) continue;
+                    }
+                    v[kept++] = v[i];
+                }
+                v.resize(kept);
+                v.shrink_to_fit();
+            }
+
+            std::vector<IpPrefixTable::Prefix> v4_;
+            std::vector<IpPrefixTable::Prefix> v6_;
+            size_t rejected_ = 0;
+        };
+
+        IpBlocklist() = default;
+        IpBlocklist(IpBlocklist const&) = delete;
+        IpBlocklist& operator=(IpBlocklist const&) = delete;
+
+        /**
+         * Swap table in. Replaced table is freed by whoever drops the last reference to it,
+         * this call or lookup still using it.
+         */
+        void update(std::shared_ptr<IpPrefixTable const> table) {
+            std::atomic_store_explicit(&table_, std::move(table), std::memory_order_release);
+        }
+
+        bool blocked(sockaddr const* sa) const {
+            if(not sa) return false;
+            auto const t = std::atomic_load_explicit(&table_, std::memory_order_acquire);
+            if(not t) return false;
+
+            if(sa->sa_family == AF_INET) {
+                return t->contains_v4(ntohl(reinterpret_cast<sockaddr_in const*>(sa)->sin_addr.s_addr));
+            }
+            if(sa->sa_family == AF_INET6) {
+                auto const key = to_key(reinterpret_cast<sockaddr_in6 const*>(sa)->sin6_addr);
+
+                // IPv4 client on dual-stack socket
+                if(static_cast<uint64_t>(key >> 64) == 0 and static_cast<uint32_t>(key >> 32) == 0xffff)
+                    return t->contains_v4(static_cast<uint32_t>(key));
+                return t->contains_v6(key);
+            }
+            return false;
+        }
+
+        bool blocked(std::string const& ip) const {
+            sockaddr_storage ss{};
+            auto* s4 = reinterpret_cast<sockaddr_in*>(&ss);
+            auto* s6 = reinterpret_cast<sockaddr_in6*>(&ss);
+
+            if(inet_pton(AF_INET, ip.c_str(), &s4->sin_addr) == 1) s4->sin_family = AF_INET;
+            else if(inet_pton(AF_INET6, ip.c_str(), &s6->sin6_addr) == 1) s6->sin6_family = AF_INET6;
+            else return false;
+
+            return blocked(reinterpret_cast<sockaddr const*>(&ss));
+        }
+
+        std::shared_ptr<IpPrefixTable const> table() const {
+            return std::atomic_load_explicit(&table_, std::memory_order_acquire);
+        }
+
+        /**
+         * Accept policy rejecting blocked peers.
+         */
+        static std::function<bool(sockaddr const*, socklen_t)> policy(std::shared_ptr<IpBlocklist const> bl) {
+            return [bl = std::move(bl)](sockaddr const* sa, socklen_t) { return not bl->blocked(sa); };
+        }
+
+    private:
+        static IpPrefixTable::key_t to_key(in6_addr const& a) {
+            IpPrefixTable::key_t k = 0;
+            for(auto b: a.s6_addr) k = (k << 8) | b;
+            return k;
+        }
+
+        // accessed only by std::atomic_load/atomic_store
+        std::shared_ptr<IpPrefixTable const> table_;
+    };
+}
+#endif //LMHTTPD_BLOCKLIST_HPP
@@ -0,0 +1,285 @@
+/*
+ *
+Copyright (c) 2021, Ales Stibal <astib@mag0.net>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+        modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+        IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+        FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+        DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+        SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+        CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#ifndef LMHTTPD_BUNDLE_HPP
+#define LMHTTPD_BUNDLE_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <lmhttpd.hpp>
+
+namespace lmh {
+
+    /**
+     * Asset bundle file layout, produced by tools/lmh_bundle.
+     * Numbers are in host byte order - bundle is built for the target it is served on.
+     *
+     *   BundleHeader | BundleEntry[count] sorted by path | strings and asset data
+     *
+     * All offsets are absolute from the beginning of the file. Strings (path, content type, etag)
+     * are followed by NUL which is not counted in their size, so they can be passed to libmicrohttpd directly.
+     */
+    namespace bundle {
+        constexpr char magic[8] = { 'L', 'M', 'H', 'B', 'N', 'D', 'L', '\0' };
+        constexpr uint32_t version = 1;
+
+        enum variant_t : uint32_t { IDENTITY = 0, GZIP, BROTLI, VARIANT_COUNT };
+        constexpr std::string_view variant_encoding[VARIANT_COUNT] = { "identity", "gzip", "br" };
+        constexpr std::string_view variant_suffix[VARIANT_COUNT] = { "", ".gz", ".br" };
+        constexpr std::string_view variant_etag_suffix[VARIANT_COUNT] = { "", "-gz", "-br" };
+
+        struct Ref {
+            uint64_t offset = 0;
+            uint64_t size = 0;
+        };
+
+        struct BundleHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t count;
+            uint64_t index_offset;
+        };
+
+        struct BundleEntry {
+            Ref path;
+            Ref content_type;
+            Ref etag;
+            Ref variants[VARIANT_COUNT];
+        };
+    }
+
+/**
+ * Read-only view of an asset bundle. Whole file is mapped at once, index is used directly from the mapping.
+ */
+    class AssetBundle {
+    public:
+        struct Asset {
+            std::string_view path;
+            std::string_view content_type;
+            std::string_view etag;
+            std::string_view variants[bundle::VARIANT_COUNT];
+        };
+
+        AssetBundle() = default;
+        explicit AssetBundle(std::string const& filename) { open(filename); }
+        AssetBundle(AssetBundle const&) = delete;
+        AssetBundle& operator=(AssetBundle const&) = delete;
+        ~AssetBundle() { close(); }
+
+        bool open(std::string const& filename) {
+            close();
+
+            auto fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd < 0) return false;
+
+            struct stat st{};
+            if(fstat(fd, &st) != 0 or static_cast<size_t>(st.st_size) < sizeof(bundle::BundleHeader)) {
+                ::close(fd);
+                return false;
+            }
+
+            auto* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if(mem == MAP_FAILED) return false;
+
+            base_ = static_cast<const char*>(mem);
+            size_ = st.st_size;
+
+            if(not validate()) {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        void close() {
+            if(base_) munmap(const_cast<char*>(base_), size_);
+            base_ = nullptr;
+            size_ = 0;
+            index_ = nullptr;
+            count_ = 0;
+        }
+
+        bool valid() const { return base_ != nullptr; }
+        size_t size() const { return count_; }
+
+        std::optional<Asset> find(std::string_view path) const {
+            // index is sorted by path
+            auto const* end = index_ + count_;
+            auto const* it = std::lower_bound(index_, end, path, [this](auto const& e, std::string_view p) {
+                return view(e.path) < p;
+            });
+            if(it == end or view(it->path) != path)
+                return std::nullopt;
+
+            Asset a;
+            a.path = view(it->path);
+            a.content_type = view(it->content_type);
+            a.etag = view(it->etag);
+            for(unsigned i = 0; i < bundle::VARIANT_COUNT; ++i)
+                a.variants[i] = view(it->variants[i]);
+
+            return a;
+        }
+
+    private:
+        std::string_view view(bundle::Ref const& r) const {
+            return { base_ + r.offset, static_cast<size_t>(r.size) };
+        }
+
+        bool in_range(bundle::Ref const& r) const {
+            return r.offset <= size_ and r.size <= size_ - r.offset;
+        }
+
+        bool is_string(bundle::Ref const& r) const {
+            return r.offset < size_ and r.size < size_ - r.offset and base_[r.offset + r.size] == '\0';
+        }
+
+        bool validate() {
+            bundle::BundleHeader hdr{};
+            memcpy(&hdr, base_, sizeof(hdr));
+
+            if(memcmp(hdr.magic, bundle::magic, sizeof(hdr.magic)) != 0 or hdr.version != bundle::version)
+                return false;
+
+            if(hdr.index_offset % alignof(bundle::BundleEntry) != 0 or hdr.index_offset > size_ or
+               hdr.count > (size_ - hdr.index_offset) / sizeof(bundle::BundleEntry))
+                return false;
+
+            index_ = reinterpret_cast<bundle::BundleEntry const*>(base_ + hdr.index_offset);
+            count_ = hdr.count;
+
+            // check once at startup, so lookups don't need to
+            for(size_t i = 0; i < count_; ++i) {
+                auto const& e = index_[i];
+                if(not is_string(e.path) or not is_string(e.content_type) or not is_string(e.etag))
+                    return false;
+                for(auto const& v: e.variants)
+                    if(not in_range(v)) return false;
+            }
+            return true;
+        }
+
+        const char* base_ = nullptr;
+        size_t size_ = 0;
+        bundle::BundleEntry const* index_ = nullptr;
+        size_t count_ = 0;
+    };
+
+/**
+ * Serves assets from mapped bundle, bytes are handed to libmicrohttpd as persistent memory.
+ */
+    class BundleController: public Controller {
+    public:
+        explicit BundleController(std::shared_ptr<AssetBundle> bundle, std::string prefix = "/")
+            : bundle_(std::move(bundle)), prefix_(std::move(prefix)) {}
+
+        MethodSet methods() const override { return Method::GET | Method::HEAD; }
+
+        bool validRoute(const char* path, Method) override {
+            return lookup(path).has_value();
+        }
+
+        int handleRequest(struct MHD_Connection* connection,
+                          const char* url, const char* method, const char* upload_data,
+                          size_t* upload_data_size, void** ptr) override {
+
+            auto const asset = lookup(url);
+            if(not asset) {
+                auto* response = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+                auto ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
+                MHD_destroy_response(response);
+                return ret;
+            }
+
+            auto variant = bundle::IDENTITY;
+            auto const* ae = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+            for(auto v: { bundle::BROTLI, bundle::GZIP }) {
+                if(not asset->variants[v].empty() and accepts_encoding(ae, bundle::variant_encoding[v])) {
+                    variant = v;
+                    break;
+                }
+            }
+
+            // each encoding is a different representation, it needs its own strong etag
+            auto const etag = variant_etag(asset->etag, variant);
+            auto const* inm = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+            if(inm and not etag.empty() and std::string_view(inm).find(etag) != std::string_view::npos) {
+                auto* response = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+                MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag.c_str());
+                MHD_add_response_header(response, MHD_HTTP_HEADER_VARY, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+                auto ret = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, response);
+                MHD_destroy_response(response);
+                return ret;
+            }
+
+            auto const& data = asset->variants[variant];
+            auto* response = MHD_create_response_from_buffer(data.size(), (void*) data.data(), MHD_RESPMEM_PERSISTENT);
+
+            MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, asset->content_type.data());
+            if(not etag.empty())
+                MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag.c_str());
+            if(variant != bundle::IDENTITY)
+                MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING, bundle::variant_encoding[variant].data());
+            MHD_add_response_header(response, MHD_HTTP_HEADER_VARY, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+
+            auto ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+            MHD_destroy_response(response);
+            return ret;
+        }
+
+    private:
+        // "\"hash\"" of identity becomes "\"hash-gz\"" for gzip variant
+        static std::string variant_etag(std::string_view etag, bundle::variant_t variant) {
+            std::string tagged(etag);
+            if(tagged.empty() or variant == bundle::IDENTITY) return tagged;
+
+            auto const at = tagged.back() == '"' ? tagged.size() - 1 : tagged.size();
+            tagged.insert(at, bundle::variant_etag_suffix[variant]);
+            return tagged;
+        }
+
+        std::optional<AssetBundle::Asset> lookup(std::string_view path) const {
+            if(not bundle_ or path.compare(0, prefix_.size(), prefix_) != 0)
+                return std::nullopt;
+
+            // bundle paths are stored with leading slash
+            path.remove_prefix(prefix_.size() - (prefix_.empty() or prefix_.back() != '/' ? 0 : 1));
+            return bundle_->find(path);
+        }
+
+        std::shared_ptr<AssetBundle> bundle_;
+        std::string prefix_;
+    };
+}
+#endif //LMHTTPD_BUNDLE_HPP
@@ -0,0 +1,1016 @@
+/*
+ *
+Copyright (c) 2021, Ales Stibal <astib@mag0.net>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+        modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+        IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+        FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+        DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+        SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+        CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#ifndef LMHTTPD_CACHE_HPP
+#define LMHTTPD_CACHE_HPP
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <strings.h>
+
+#include <lmhttpd.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <array>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+namespace lmh {
+
+/**
+ * Fixed-size response store in shared memory, shared by processes on the same host: named segment (shm_open)
+ * for independent processes, anonymous one for processes forked after it's created.
+ *
+ * Segment is an open addressing table of equally sized slots (slot holds key, headers and body of one response).
+ * Readers don't lock: slot is guarded by sequence counter, odd while being written, and data copied out of it
+ * are used only if the counter didn't change meanwhile. Writers take slot by making the counter odd,
+ * contended slot is simply skipped. Slot left odd for longer than abandoned_ms (its writer died in the middle)
+ * is taken over by the next writer. Responses which don't fit into slot are not shared.
+ *
+ * Hits are copied out of the mapping: slot can be reused by another process while the response is still being sent.
+ * Expiration uses wall clock, as steady clock isn't comparable across processes.
+ */
+    class SharedResponseStore {
+    public:
+        static constexpr uint64_t magic = 0x4c4d485348434832ULL; // "LMHSHCH2"
+        static constexpr unsigned probe_count = 4;
+        static constexpr int64_t abandoned_ms = 1000;   // writing slot takes microseconds
+
+        struct options_t {
+            uint32_t slots = 4096;
+            uint32_t slot_size = 16 * 1024;
+        };
+
+        SharedResponseStore() = default;
+        SharedResponseStore(SharedResponseStore const&) = delete;
+        SharedResponseStore& operator=(SharedResponseStore const&) = delete;
+        ~SharedResponseStore() { close(); }
+
+        /**
+         * Create or attach to segment. Empty name creates anonymous segment, shared with children forked later.
+         * Attaching to existing segment fails if it was created with different options.
+         */
+        bool open(std::string const& name) { return open(name, options_t()); }
+        bool open(std::string const& name, options_t const& o) {
+            close();
+
+            if(o.slots == 0) return false;
+            size_t const size = slots_offset() + static_cast<size_t>(o.slots) * stride(o.slot_size);
+
+            if(name.empty()) {
+                auto* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+                if(mem == MAP_FAILED) return false;
+                attach(mem, size);
+                init(o);
+                return true;
+            }
+
+            bool created = true;
+            auto fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if(fd < 0 and errno == EEXIST) {
+                created = false;
+                fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0600);
+            }
+            if(fd < 0) return false;
+
+            if(created and ftruncate(fd, static_cast<off_t>(size)) != 0) {
+                ::close(fd);
+                shm_unlink(name.c_str());
+                return false;
+            }
+
+            struct stat st{};
+            if(fstat(fd, &st) != 0 or static_cast<size_t>(st.st_size) != size) {
+                ::close(fd);
+                return false;
+            }
+
+            auto* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if(mem == MAP_FAILED) return false;
+            attach(mem, size);
+
+            if(created) {
+                init(o);
+                return true;
+            }
+
+            // creator may be still initializing
+            for(int i = 0; i < 1000 and header()->ready.load(std::memory_order_acquire) == 0; ++i) {
+                timespec ts { 0, 1000000 };
+                nanosleep(&ts, nullptr);
+            }
+            if(header()->ready.load(std::memory_order_acquire) == 0 or header()->magic != magic
+               or header()->slots != o.slots or header()->slot_size != o.slot_size) {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        void close() {
+            if(base_) munmap(base_, size_);
+            base_ = nullptr;
+            size_ = 0;
+        }
+
+        bool valid() const { return base_ != nullptr; }
+
+        /**
+         * Store response (headers packed by ResponseCache::pack_headers()), false if it doesn't fit into slot
+         * or all candidate slots are being written.
+         */
+        bool put(std::string_view key, std::string_view headers, std::string_view body,
+                 int64_t fresh_until_ms, int64_t stale_until_ms) {
+            if(not base_) return false;
+            if(key.size() + headers.size() + body.size() > header()->slot_size) return false;
+
+            auto const hash = fnv1a(key);
+            auto const now = now_ms();
+            Slot* victim = nullptr;
+
+            // same key, otherwise empty or expired slot, otherwise the first one
+            for(unsigned i = 0; i < probe_count; ++i) {
+                auto* sl = slot(hash, i);
+                if(sl->hash == hash) { victim = sl; break; }
+                if(not victim and (sl->hash == 0 or sl->stale_until_ms <= now)) victim = sl;
+            }
+            if(not victim) victim = slot(hash, 0);
+
+            // odd counter is write in progress, unless it's been odd for too long
+            auto seq = victim->seq.load(std::memory_order_relaxed);
+            if(seq & 1 and now - victim->locked_ms.load(std::memory_order_relaxed) < abandoned_ms)
+                return false;
+
+            // set before taking the slot, so live writer never looks abandoned; taken over slot stays odd
+            victim->locked_ms.store(now, std::memory_order_relaxed);
+            auto const locked = seq & 1 ? seq + 2 : seq + 1;
+            if(not victim->seq.compare_exchange_strong(seq, locked, std::memory_order_acquire))
+                return false;
+            std::atomic_thread_fence(std::memory_order_release);
+
+            victim->hash = hash;
+            victim->fresh_until_ms = fresh_until_ms;
+            victim->stale_until_ms = stale_until_ms;
+            victim->key_size = static_cast<uint32_t>(key.size());
+            victim->headers_size = static_cast<uint32_t>(headers.size());
+            victim->body_size = static_cast<uint32_t>(body.size());
+
+            auto* d = victim->data();
+            memcpy(d, key.data(), key.size());
+            memcpy(d + key.size(), headers.data(), headers.size());
+            memcpy(d + key.size() + headers.size(), body.data(), body.size());
+
+            victim->seq.store(locked + 1, std::memory_order_release);
+            return true;
+        }
+
+        /**
+         * Copy of usable entry for key, false if there is none.
+         */
+        bool get(std::string_view key, std::string& headers, std::string& body,
+                 int64_t& fresh_until_ms, int64_t& stale_until_ms) const {
+            if(not base_) return false;
+
+            auto const hash = fnv1a(key);
+            auto const now = now_ms();
+
+            for(unsigned i = 0; i < probe_count; ++i) {
+                auto* sl = slot(hash, i);
+
+                auto const seq = sl->seq.load(std::memory_order_acquire);
+                if(seq & 1 or sl->hash != hash) continue;
+
+                fresh_until_ms = sl->fresh_until_ms;
+                stale_until_ms = sl->stale_until_ms;
+                size_t const key_size = sl->key_size;
+                size_t const headers_size = sl->headers_size;
+                size_t const body_size = sl->body_size;
+                if(stale_until_ms <= now or key_size + headers_size + body_size > header()->slot_size) continue;
+
+                auto const* d = sl->data();
+                if(std::string_view(d, key_size) != key) continue;
+
+                headers.assign(d + key_size, headers_size);
+                body.assign(d + key_size + headers_size, body_size);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if(sl->seq.load(std::memory_order_relaxed) == seq) return true;
+            }
+            return false;
+        }
+
+        static int64_t now_ms() {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+    private:
+        static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory needs address-free atomics");
+
+        struct Header {
+            uint64_t magic;
+            uint32_t slots;
+            uint32_t slot_size;
+            std::atomic<uint32_t> ready;
+        };
+
+        struct alignas(64) Slot {
+            std::atomic<uint64_t> seq;
+            std::atomic<int64_t> locked_ms;     // wall clock when the last writer took slot
+            uint64_t hash;
+            int64_t fresh_until_ms;
+            int64_t stale_until_ms;
+            uint32_t key_size;
+            uint32_t headers_size;
+            uint32_t body_size;
+
+            char* data() { return reinterpret_cast<char*>(this + 1); }
+            const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+        };
+
+        static size_t stride(uint32_t slot_size) {
+            return (sizeof(Slot) + slot_size + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+        }
+
+        static size_t slots_offset() {
+            return (sizeof(Header) + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+        }
+
+        void attach(void* mem, size_t size) {
+            base_ = static_cast<char*>(mem);
+            size_ = size;
+        }
+
+        // fresh mapping is zero filled, which is valid empty table
+        void init(options_t const& o) {
+            header()->magic = magic;
+            header()->slots = o.slots;
+            header()->slot_size = o.slot_size;
+            header()->ready.store(1, std::memory_order_release);
+        }
+
+        Header* header() const { return reinterpret_cast<Header*>(base_); }
+
+        Slot* slot(uint64_t hash, unsigned probe) const {
+            auto const index = (hash + probe) % header()->slots;
+            return reinterpret_cast<Slot*>(base_ + slots_offset() + index * stride(header()->slot_size));
+        }
+
+        char* base_ = nullptr;
+        size_t size_ = 0;
+    };
+
+/**
+ * 128-bit cache key. Keys are compared by value only, two requests hashing to the same key share the entry.
+ */
+    struct CacheKey {
+        uint64_t hi = 0;
+        uint64_t lo = 0;
+
+        bool operator==(CacheKey const& o) const { return hi == o.hi and lo == o.lo; }
+        bool operator!=(CacheKey const& o) const { return not (*this == o); }
+
+        // key as stored in snapshot and shared store
+        std::string_view bytes() const { return { reinterpret_cast<const char*>(this), sizeof(*this) }; }
+
+        struct hash {
+            size_t operator()(CacheKey const& k) const { return static_cast<size_t>(k.lo ^ (k.hi * 0x9e3779b97f4a7c15ULL)); }
+        };
+    };
+    static_assert(sizeof(CacheKey) == 16);
+
+/**
+ * FNV-1a 128 over key parts, fed directly from request data without building the key string.
+ * Parts are separated by end_part(), so "ab" + "c" and "a" + "bc" differ.
+ */
+    class KeyHasher {
+    public:
+        KeyHasher& update(std::string_view data) {
+            for(auto c: data) mix(static_cast<unsigned char>(c));
+            return *this;
+        }
+
+        // ASCII case folded, whitespace skipped
+        KeyHasher& update_normalized(std::string_view data) {
+            for(auto c: data) {
+                if(c == ' ' or c == '\t') continue;
+                mix(static_cast<unsigned char>(c >= 'A' and c <= 'Z' ? c + ('a' - 'A') : c));
+            }
+            return *this;
+        }
+
+        KeyHasher& update(uint64_t v) {
+            for(int i = 0; i < 8; ++i) mix(static_cast<unsigned char>(v >> (i * 8)));
+            return *this;
+        }
+
+        KeyHasher& end_part() {
+            mix(0xff);
+            return *this;
+        }
+
+        CacheKey key() const { return { static_cast<uint64_t>(h_ >> 64), static_cast<uint64_t>(h_) }; }
+
+    private:
+        using u128 = unsigned __int128;
+        static constexpr u128 offset = (static_cast<u128>(0x6c62272e07bb0142ULL) << 64) | 0x62b821756295c58dULL;
+        static constexpr u128 prime = (static_cast<u128>(0x0000000001000000ULL) << 64) | 0x000000000000013bULL;
+
+        void mix(unsigned char c) {
+            h_ ^= c;
+            h_ *= prime;
+        }
+
+        u128 h_ = offset;
+    };
+
+/**
+ * Snapshot of ResponseCache written on shutdown, so restarted process starts warm.
+ * Layout follows asset bundle (numbers in host byte order, absolute offsets):
+ *
+ *   SnapshotHeader | SnapshotEntry[count] sorted by key | keys, headers and bodies
+ *
+ * Snapshot is mapped, not read: entries are looked up and copied into the cache only when requested.
+ */
+    namespace snapshot {
+        constexpr char magic[8] = { 'L', 'M', 'H', 'S', 'N', 'A', 'P', '\0' };
+        constexpr uint32_t version = 1;
+
+        struct Ref {
+            uint64_t offset = 0;
+            uint64_t size = 0;
+        };
+
+        struct SnapshotHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t count;
+            uint64_t index_offset;
+        };
+
+        struct SnapshotEntry {
+            Ref key;
+            Ref headers;
+            Ref body;
+            int64_t fresh_until_ms;    // wall clock
+            int64_t stale_until_ms;
+        };
+    }
+
+/**
+ * Cache of ready MHD responses keyed by request. Entry is fresh for ttl and then stale for
+ * stale_while_revalidate: stale entry is still served while it's being refreshed in the background.
+ *
+ * Entries are immutable and refcounted, refresh replaces whole entry. Body of replaced entry lives
+ * until the last connection sending it is done.
+ *
+ * Misses are looked up in loaded snapshot and in shared store, in that order.
+ */
+    class ResponseCache {
+    public:
+        using clock_t = std::chrono::steady_clock;
+
+        struct options_t {
+            std::chrono::milliseconds ttl { 1000 };
+            std::chrono::milliseconds stale_while_revalidate { 10000 };
+            size_t max_entries = 1024;
+        };
+
+        struct Entry {
+            // headers are packed by pack_headers()
+            Entry(std::string h, std::string b, clock_t::time_point fresh, clock_t::time_point stale)
+                : headers(std::move(h)), fresh_until(fresh), stale_until(stale) {
+
+                body_.add_owned(std::move(b));
+                response = body_.create_response();
+                if(response) {
+                    for_each_header(headers, [this](const char* hdr, const char* val) {
+                        MHD_add_response_header(response, hdr, val);
+                    });
+                }
+            }
+            Entry(Entry const&) = delete;
+            Entry& operator=(Entry const&) = delete;
+            ~Entry() { if(response) MHD_destroy_response(response); }
+
+            bool fresh(clock_t::time_point now) const { return now < fresh_until; }
+            bool usable(clock_t::time_point now) const { return now < stale_until; }
+            std::string_view body() const { return body_.empty() ? std::string_view() : body_.segments.front(); }
+
+            MHD_Response* response = nullptr;
+            std::string const headers;
+            clock_t::time_point const fresh_until;
+            clock_t::time_point const stale_until;
+
+            // only one refresh per entry at a time
+            mutable std::atomic<bool> refreshing { false };
+
+        private:
+            ResponseBody body_;
+        };
+        using handle_t = std::shared_ptr<Entry const>;
+
+        struct stats_t {
+            std::atomic<uint64_t> hits { 0 };
+            std::atomic<uint64_t> stale_hits { 0 };
+            std::atomic<uint64_t> misses { 0 };
+            std::atomic<uint64_t> refreshes { 0 };
+            std::atomic<uint64_t> shared_hits { 0 };
+            std::atomic<uint64_t> snapshot_hits { 0 };
+        };
+
+        ResponseCache() : ResponseCache(options_t()) {}
+        explicit ResponseCache(options_t const& o) : options_(o) {}
+        ResponseCache(ResponseCache const&) = delete;
+        ResponseCache& operator=(ResponseCache const&) = delete;
+        ~ResponseCache() { unload_snapshot(); }
+
+        options_t const& options() const { return options_; }
+        stats_t const& stats() const { return stats_; }
+
+        /**
+         * Use shared store as second level: local misses are looked up there, stored responses are published there.
+         */
+        void share(std::shared_ptr<SharedResponseStore> store) { shared_ = std::move(store); }
+        std::shared_ptr<SharedResponseStore> const& shared() const { return shared_; }
+
+        /**
+         * Headers as "name\0value\0" pairs, as entries and stores keep them.
+         */
+        template <typename Headers>
+        static std::string pack_headers(Headers const& headers) {
+            std::string packed;
+            for(auto const& [h, v]: headers) {
+                packed.append(h.data(), h.size()).push_back('\0');
+                packed.append(v.data(), v.size()).push_back('\0');
+            }
+            return packed;
+        }
+
+        template <typename Fn>
+        static void for_each_header(std::string_view packed, Fn&& fn) {
+            while(not packed.empty()) {
+                auto const* h = packed.data();
+                auto const hs = packed.find('\0');
+                if(hs == std::string_view::npos) return;
+                auto const* v = h + hs + 1;
+                auto const vs = packed.find('\0', hs + 1);
+                if(vs == std::string_view::npos) return;
+
+                fn(h, v);
+                packed.remove_prefix(vs + 1);
+            }
+        }
+
+        /**
+         * Usable (fresh or stale) entry, null if there is none.
+         */
+        handle_t get(CacheKey const& key) {
+            auto const now = clock_t::now();
+            {
+                auto l_ = std::lock_guard(lock_);
+
+                auto it = entries_.find(key);
+                if(it != entries_.end() and it->second->usable(now)) {
+                    ++(it->second->fresh(now) ? stats_.hits : stats_.stale_hits);
+                    return it->second;
+                }
+            }
+
+            std::string headers;
+            std::string body;
+            int64_t fresh_ms = 0;
+            int64_t stale_ms = 0;
+
+            auto const from_snapshot = snapshot_find(key.bytes(), headers, body, fresh_ms, stale_ms);
+            if(from_snapshot or (shared_ and shared_->get(key.bytes(), headers, body, fresh_ms, stale_ms))) {
+
+                // deadlines are wall clock outside of this process
+                auto const wall = SharedResponseStore::now_ms();
+                auto e = std::make_shared<Entry const>(std::move(headers), std::move(body),
+                                                       now + std::chrono::milliseconds(fresh_ms - wall),
+                                                       now + std::chrono::milliseconds(stale_ms - wall));
+                ++(from_snapshot ? stats_.snapshot_hits : stats_.shared_hits);
+                insert(key, e, now);
+                return e;
+            }
+
+            ++stats_.misses;
+            return nullptr;
+        }
+
+        /**
+         * Store response created in state under key, replacing existing entry, and publish it to shared store.
+         * Response is response_data with response_headers, as DynamicController::buildResponse() makes it.
+         */
+        handle_t put(CacheKey const& key, ConnectionState const& state) {
+            auto const now = clock_t::now();
+            auto e = std::make_shared<Entry const>(pack_headers(state.response_headers),
+                                                   std::string(state.response_data.data(), state.response_data.size()),
+                                                   now + options_.ttl,
+                                                   now + options_.ttl + options_.stale_while_revalidate);
+            if(not e->response) return nullptr;
+            insert(key, e, now);
+
+            if(shared_) {
+                auto const wall = SharedResponseStore::now_ms();
+                auto const ttl = options_.ttl.count();
+                shared_->put(key.bytes(), e->headers, e->body(), wall + ttl, wall + ttl + options_.stale_while_revalidate.count());
+            }
+            return e;
+        }
+
+        /**
+         * True if caller should refresh the entry, false if somebody else already does.
+         */
+        bool begin_refresh(handle_t const& e) {
+            if(e->refreshing.exchange(true)) return false;
+
+            ++stats_.refreshes;
+            return true;
+        }
+
+        /**
+         * Refresh failed, entry may be refreshed again.
+         */
+        void abort_refresh(handle_t const& e) { e->refreshing = false; }
+
+        void erase(CacheKey const& key) {
+            auto l_ = std::lock_guard(lock_);
+            entries_.erase(key);
+        }
+
+        void clear() {
+            auto l_ = std::lock_guard(lock_);
+            entries_.clear();
+        }
+
+        size_t size() const {
+            auto l_ = std::lock_guard(lock_);
+            return entries_.size();
+        }
+
+        /**
+         * Write usable entries to file (replaced atomically), together with not yet requested entries
+         * of loaded snapshot which are still usable.
+         */
+        bool save_snapshot(std::string const& filename) const {
+            struct item_t {
+                std::string_view headers;
+                std::string_view body;
+                int64_t fresh_until_ms;
+                int64_t stale_until_ms;
+            };
+
+            auto const now = clock_t::now();
+            auto const wall = SharedResponseStore::now_ms();
+            auto const to_wall = [&](clock_t::time_point tp) {
+                return wall + std::chrono::duration_cast<std::chrono::milliseconds>(tp - now).count();
+            };
+
+            // std::map keeps keys sorted, as the index requires; entries are held while writing
+            std::map<std::string, item_t> items;
+            std::vector<handle_t> held;
+            {
+                auto l_ = std::lock_guard(lock_);
+                held.reserve(entries_.size());
+                for(auto const& [key, e]: entries_) {
+                    if(not e->usable(now)) continue;
+                    held.push_back(e);
+                    items[std::string(key.bytes())] = { e->headers, e->body(), to_wall(e->fresh_until), to_wall(e->stale_until) };
+                }
+            }
+
+            // snapshot items are views into the mapping, it's not unloaded or replaced until they are written
+            auto snapshot_l_ = std::lock_guard(snapshot_lock_);
+            if(snapshot_base_) {
+                for(size_t i = 0; i < snapshot_count_; ++i) {
+                    auto const& se = snapshot_index_[i];
+                    if(se.stale_until_ms <= wall) continue;
+                    items.emplace(std::string(snapshot_view(se.key)),
+                                  item_t { snapshot_view(se.headers), snapshot_view(se.body), se.fresh_until_ms, se.stale_until_ms });
+                }
+            }
+
+            std::vector<snapshot::SnapshotEntry> index(items.size());
+            uint64_t offset = sizeof(snapshot::SnapshotHeader) + index.size() * sizeof(snapshot::SnapshotEntry);
+            auto ref = [&offset](std::string_view v) {
+                snapshot::Ref r { offset, v.size() };
+                offset += v.size();
+                return r;
+            };
+
+            size_t i = 0;
+            for(auto const& [key, it]: items) {
+                auto& se = index[i++];
+                se.key = ref(key);
+                se.headers = ref(it.headers);
+                se.body = ref(it.body);
+                se.fresh_until_ms = it.fresh_until_ms;
+                se.stale_until_ms = it.stale_until_ms;
+            }
+
+            snapshot::SnapshotHeader hdr{};
+            memcpy(hdr.magic, snapshot::magic, sizeof(hdr.magic));
+            hdr.version = snapshot::version;
+            hdr.count = static_cast<uint32_t>(index.size());
+            hdr.index_offset = sizeof(snapshot::SnapshotHeader);
+
+            auto const tmp = filename + ".tmp";
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+            out.write(reinterpret_cast<const char*>(index.data()), static_cast<std::streamsize>(index.size() * sizeof(snapshot::SnapshotEntry)));
+            for(auto const& [key, it]: items) {
+                out.write(key.data(), static_cast<std::streamsize>(key.size()));
+                out.write(it.headers.data(), static_cast<std::streamsize>(it.headers.size()));
+                out.write(it.body.data(), static_cast<std::streamsize>(it.body.size()));
+            }
+            out.close();
+
+            if(not out or ::rename(tmp.c_str(), filename.c_str()) != 0) {
+                ::unlink(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Map snapshot written by save_snapshot(). Nothing is read yet, entries are taken from it on cache misses.
+         */
+        bool load_snapshot(std::string const& filename) {
+            auto fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd < 0) return false;
+
+            struct stat st{};
+            if(fstat(fd, &st) != 0 or static_cast<size_t>(st.st_size) < sizeof(snapshot::SnapshotHeader)) {
+                ::close(fd);
+                return false;
+            }
+
+            auto* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if(mem == MAP_FAILED) return false;
+
+            auto const* base = static_cast<const char*>(mem);
+            size_t const size = st.st_size;
+
+            snapshot::SnapshotHeader hdr{};
+            memcpy(&hdr, base, sizeof(hdr));
+
+            auto in_range = [size](snapshot::Ref const& r) { return r.offset <= size and r.size <= size - r.offset; };
+
+            bool valid = memcmp(hdr.magic, snapshot::magic, sizeof(hdr.magic)) == 0 and hdr.version == snapshot::version
+                    and hdr.index_offset % alignof(snapshot::SnapshotEntry) == 0 and hdr.index_offset <= size
+                    and hdr.count <= (size - hdr.index_offset) / sizeof(snapshot::SnapshotEntry);
+
+            auto const* index = reinterpret_cast<snapshot::SnapshotEntry const*>(base + hdr.index_offset);
+            for(size_t i = 0; valid and i < hdr.count; ++i) {
+                valid = in_range(index[i].key) and in_range(index[i].headers) and in_range(index[i].body);
+            }
+
+            if(not valid) {
+                munmap(mem, size);
+                return false;
+            }
+
+            auto l_ = std::lock_guard(snapshot_lock_);
+            unload();
+            snapshot_base_ = base;
+            snapshot_size_ = size;
+            snapshot_index_ = index;
+            snapshot_count_ = hdr.count;
+            return true;
+        }
+
+        void unload_snapshot() {
+            auto l_ = std::lock_guard(snapshot_lock_);
+            unload();
+        }
+
+    private:
+        std::string_view snapshot_view(snapshot::Ref const& r) const {
+            return { snapshot_base_ + r.offset, static_cast<size_t>(r.size) };
+        }
+
+        bool snapshot_find(std::string_view key, std::string& headers, std::string& body,
+                           int64_t& fresh_until_ms, int64_t& stale_until_ms) const {
+            auto l_ = std::lock_guard(snapshot_lock_);
+            if(not snapshot_base_) return false;
+
+            auto const* end = snapshot_index_ + snapshot_count_;
+            auto const* it = std::lower_bound(snapshot_index_, end, key, [this](auto const& e, std::string_view k) {
+                return snapshot_view(e.key) < k;
+            });
+            if(it == end or snapshot_view(it->key) != key or it->stale_until_ms <= SharedResponseStore::now_ms())
+                return false;
+
+            headers = snapshot_view(it->headers);
+            body = snapshot_view(it->body);
+            fresh_until_ms = it->fresh_until_ms;
+            stale_until_ms = it->stale_until_ms;
+            return true;
+        }
+
+        void unload() {
+            if(snapshot_base_) munmap(const_cast<char*>(snapshot_base_), snapshot_size_);
+            snapshot_base_ = nullptr;
+            snapshot_size_ = 0;
+            snapshot_index_ = nullptr;
+            snapshot_count_ = 0;
+        }
+
+        void insert(CacheKey const& key, handle_t e, clock_t::time_point now) {
+            auto l_ = std::lock_guard(lock_);
+            if(entries_.size() >= options_.max_entries and entries_.find(key) == entries_.end()) {
+                evict(now);
+            }
+            entries_[key] = std::move(e);
+        }
+
+        void evict(clock_t::time_point now) {
+            for(auto it = entries_.begin(); it != entries_.end(); ) {
+                if(not it->second->usable(now)) it = entries_.erase(it);
+                else ++it;
+            }
+
+            // still full, make room for one
+            if(entries_.size() >= options_.max_entries and not entries_.empty())
+                entries_.erase(entries_.begin());
+        }
+
+        options_t options_;
+        stats_t stats_;
+        std::shared_ptr<SharedResponseStore> shared_;
+
+        mutable std::mutex lock_;
+        std::unordered_map<CacheKey, handle_t, CacheKey::hash> entries_;
+
+        mutable std::mutex snapshot_lock_;
+        const char* snapshot_base_ = nullptr;
+        size_t snapshot_size_ = 0;
+        snapshot::SnapshotEntry const* snapshot_index_ = nullptr;
+        size_t snapshot_count_ = 0;
+    };
+
+/**
+ * DynamicController with responses cached in ResponseCache.
+ *
+ * Fresh entry is queued directly without calling createResponse(). Stale entry of refreshable() controller
+ * is queued too, and one background refresh of it runs createResponse() on the worker pool given to offload().
+ * Otherwise stale entries are regenerated in place, like misses.
+ *
+ * Key is made of route id, method, url, query arguments, values of vary() headers and identity of authenticated
+ * client (see Controller::authenticator()), hashed as they are read from libmicrohttpd. Responses get matching
+ * Vary header.
+ *
+ * With snapshot() set, cache is saved on WebServer::stop_daemon() and the next process serves from it.
+ *
+ * Cached response is what createResponse() wrote, with its headers. buildResponse() is final, so responses
+ * sent on misses are the same as those served from cache, shared store and snapshot.
+ *
+ * Background refresh has no request to work with: createResponse() gets null connection and the path only.
+ * So it's used just for entries keyed by the path alone (no query arguments, no vary() headers).
+ */
+    class CachedController: public DynamicController {
+    public:
+        static constexpr size_t max_vary = 8;
+
+        struct vary_t {
+            std::string name;
+            bool normalize = true;      // fold case and skip whitespace, not for credentials or cookies
+        };
+
+        explicit CachedController(std::shared_ptr<ResponseCache> cache = std::make_shared<ResponseCache>(),
+                                  std::string_view route_id = {})
+            : cache_(std::move(cache)), route_id_(fnv1a(route_id)) {}
+
+        /**
+         * Request headers selecting response variant, ie. Accept-Encoding, Accept-Language. Up to max_vary.
+         */
+        void vary(std::vector<vary_t> headers) {
+            vary_.clear();
+            vary_header_.clear();
+            for(auto& v: headers) {
+                if(vary_.size() == max_vary) break;
+
+                auto const name_hash = folded_hash(v.name);
+                if(not vary_header_.empty()) vary_header_ += ", ";
+                vary_header_ += v.name;
+                vary_.push_back({ std::move(v), name_hash });
+            }
+        }
+
+        /**
+         * Key of cached response, nullopt is not to cache. Default caches GET and HEAD.
+         */
+        virtual std::optional<CacheKey> cacheKey(struct MHD_Connection* connection, const char* url, Method method) {
+            if(method != Method::GET and method != Method::HEAD) return std::nullopt;
+            return request_hash(connection, url, method);
+        }
+
+        /**
+         * Stale entries may be refreshed in the background, createResponse() depends on url path only and
+         * copes with null connection. Default is false.
+         */
+        virtual bool refreshable() const { return false; }
+
+        // misses of the same key wait for the first one rather than all generating the same response
+        std::optional<std::string> coalesceKey(struct MHD_Connection* connection, const char* url, Method method) override {
+            if(auto key = cacheKey(connection, url, method); key) return std::string(key->bytes());
+            return std::nullopt;
+        }
+
+        int handleRequest(struct MHD_Connection* connection,
+                          const char* url, const char* method, const char* upload_data,
+                          size_t* upload_data_size, void** ptr) override {
+
+            if(not *ptr) {
+                auto const m = parse_method(method);
+                auto key = cacheKey(connection, url, m);
+                if(not key) return DynamicController::handleRequest(connection, url, method, upload_data, upload_data_size, ptr);
+
+                if(auto e = cache_->get(*key); e) {
+                    auto const now = ResponseCache::clock_t::now();
+                    if(e->fresh(now)) {
+                        return MHD_queue_response(connection, MHD_HTTP_OK, e->response);
+                    }
+                    if(workers() and concurrent() and refreshable() and path_only(connection)) {
+                        if(cache_->begin_refresh(e)) refresh(*key, url, m, e);
+                        return MHD_queue_response(connection, MHD_HTTP_OK, e->response);
+                    }
+                }
+            }
+
+            auto* state = reinterpret_cast<ConnectionState*>(*ptr);
+            bool const was_sent = state and state->response_sent;
+
+            auto ret = DynamicController::handleRequest(connection, url, method, upload_data, upload_data_size, ptr);
+
+            // store response we've just created (coalesced followers didn't create one)
+            state = reinterpret_cast<ConnectionState*>(*ptr);
+            if(state and not was_sent and state->response_sent and state->response_created) {
+                if(auto key = cacheKey(connection, url, state->method); key) {
+                    cache_->put(*key, *state);
+                }
+            }
+
+            return ret;
+        }
+
+        std::shared_ptr<ResponseCache> const& cache() const { return cache_; }
+
+        /**
+         * Keep cache in file across restarts: existing snapshot is loaded now, new one is written on stop.
+         */
+        bool snapshot(std::string filename) {
+            snapshot_file_ = std::move(filename);
+            return cache_->load_snapshot(snapshot_file_);
+        }
+
+        void onStop() override {
+            if(not snapshot_file_.empty()) cache_->save_snapshot(snapshot_file_);
+        }
+
+    protected:
+        /**
+         * Key of request in one pass over query arguments and one over headers.
+         */
+        CacheKey request_hash(struct MHD_Connection* connection, const char* url, Method method) const {
+            KeyHasher hasher;
+            hasher.update(route_id_).update(static_cast<uint64_t>(method)).update(url).end_part();
+
+            MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND,
+                                      [](void* cls, enum MHD_ValueKind, const char* k, const char* v) -> decltype(MHD_YES) {
+                                          auto& h = *static_cast<KeyHasher*>(cls);
+                                          h.update(k).end_part();
+                                          if(v) h.update(v);
+                                          h.end_part();
+                                          return MHD_YES;
+                                      }, &hasher);
+
+            // responses of authenticated routes are per client, zero bytes (not in query arguments) mark identity part
+            if(auto const* identity = request_identity(connection); identity)
+                hasher.update(uint64_t(0)).update(identity->scheme).end_part().update(identity->subject).end_part();
+
+            if(vary_.empty()) return hasher.key();
+
+            struct scan_t {
+                std::vector<vary_entry> const& vary;
+                std::array<KeyHasher, max_vary> values;
+                std::array<bool, max_vary> present {};
+            } scan { vary_, {}, {} };
+
+            MHD_get_connection_values(connection, MHD_HEADER_KIND,
+                                      [](void* cls, enum MHD_ValueKind, const char* k, const char* v) -> decltype(MHD_YES) {
+                                          auto& sc = *static_cast<scan_t*>(cls);
+                                          auto const h = folded_hash(k);
+                                          for(size_t i = 0; i < sc.vary.size(); ++i) {
+                                              auto const& ve = sc.vary[i];
+                                              if(ve.name_hash != h or strcasecmp(ve.header.name.c_str(), k) != 0) continue;
+
+                                              // repeated header continues the same value
+                                              if(sc.present[i]) sc.values[i].update(",");
+                                              if(v) ve.header.normalize ? sc.values[i].update_normalized(v) : sc.values[i].update(v);
+                                              sc.present[i] = true;
+                                          }
+                                          return MHD_YES;
+                                      }, &scan);
+
+            for(size_t i = 0; i < vary_.size(); ++i) {
+                auto const value = scan.values[i].key();
+                hasher.update(scan.present[i] ? 1 : 0).update(value.hi).update(value.lo).end_part();
+            }
+            return hasher.key();
+        }
+
+        // final: cache keeps createResponse() output and headers, custom response wouldn't be the one served from cache
+        MHD_Response* buildResponse(ConnectionState& state) final {
+            add_vary(state);
+            return DynamicController::buildResponse(state);
+        }
+
+    private:
+        struct vary_entry {
+            vary_t header;
+            uint64_t name_hash;
+        };
+
+        static uint64_t folded_hash(std::string_view name) {
+            uint64_t h = 0xcbf29ce484222325ULL;
+            for(auto c: name) {
+                h ^= static_cast<unsigned char>(c >= 'A' and c <= 'Z' ? c + ('a' - 'A') : c);
+                h *= 0x100000001b3ULL;
+            }
+            return h;
+        }
+
+        // key of request is made of the path, so refresh regenerates the same response
+        bool path_only(struct MHD_Connection* connection) const {
+            return vary_.empty() and not request_identity(connection)
+                   and MHD_get_connection_values(connection, MHD_GET_ARGUMENT_KIND, nullptr, nullptr) == 0;
+        }
+
+        void add_vary(ConnectionState& state) const {
+            if(vary_header_.empty()) return;
+            for(auto const& [hdr, val]: state.response_headers)
+                if(strcasecmp(hdr.c_str(), MHD_HTTP_HEADER_VARY) == 0) return;
+            state.response_headers.emplace_back(MHD_HTTP_HEADER_VARY, vary_header_);
+        }
+
+        // stale entry is being served meanwhile, refresh doesn't compete with requests waiting for response
+        void refresh(CacheKey key, std::string url, Method method, ResponseCache::handle_t e) {
+            workers()->submit([this, key, url = std::move(url), method, e = std::move(e)]() {
+                ConnectionState state(*this);
+                state.method = method;
+
+                void* p = &state;
+                size_t size = 0;
+                if(not create(nullptr, url.c_str(), method_name(method), nullptr, &size, &p, state)
+                   or not cache_->put(key, state)) {
+                    cache_->abort_refresh(e);
+                }
+            }, Priority::BULK);
+        }
+
+        std::shared_ptr<ResponseCache> cache_;
+        std::string snapshot_file_;
+
+        uint64_t route_id_ = 0;
+        std::vector<vary_entry> vary_;
+        std::string vary_header_;
+    };
+}
+#endif //LMHTTPD_CACHE_HPP
@@ -0,0 +1,166 @@
+/*
+ *
+Copyright (c) 2021, Ales Stibal <astib@mag0.net>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+        modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+        IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+        FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+        DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+        SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+        CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#ifndef LMHTTPD_EMBED_HPP
+#define LMHTTPD_EMBED_HPP
+
+#include <lmhttpd.hpp>
+
+namespace lmh {
+
+    /**
+     * Resource compiled into the binary, tables are generated by lmh_embed_resources() cmake function.
+     */
+    struct EmbeddedResource {
+        std::string_view path;
+        const unsigned char* data;
+        size_t size;
+    };
+
+    /**
+     * Compile-time usable lookup in table sorted by path.
+     */
+    template<size_t N>
+    constexpr EmbeddedResource const* find_resource(EmbeddedResource const (&table)[N], std::string_view path) {
+        size_t lo = 0;
+        size_t hi = N;
+        while(lo < hi) {
+            auto const mid = lo + (hi - lo) / 2;
+            if(table[mid].path < path) lo = mid + 1;
+            else hi = mid;
+        }
+        return (lo < N and table[lo].path == path) ? &table[lo] : nullptr;
+    }
+
+/**
+ * Serves embedded resources. Responses (404 too) are created once in constructor and queued for every request,
+ * there is no filesystem access, allocation or copying when serving.
+ */
+    class EmbeddedResourceController: public Controller {
+    public:
+        template<size_t N>
+        explicit EmbeddedResourceController(EmbeddedResource const (&table)[N], std::string prefix = "/")
+            : table_(table), count_(N), prefix_(std::move(prefix)) {
+
+            responses_.reserve(N);
+            for(auto const& r: table) {
+                responses_.emplace_back(create_responses(r));
+            }
+            not_found_ = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+        }
+
+        EmbeddedResourceController(EmbeddedResourceController const&) = delete;
+        EmbeddedResourceController& operator=(EmbeddedResourceController const&) = delete;
+
+        ~EmbeddedResourceController() override {
+            for(auto const& r: responses_) {
+                if(r.ok) MHD_destroy_response(r.ok);
+                if(r.not_modified) MHD_destroy_response(r.not_modified);
+            }
+            if(not_found_) MHD_destroy_response(not_found_);
+        }
+
+        MethodSet methods() const override { return Method::GET | Method::HEAD; }
+
+        bool validRoute(const char* path, Method) override {
+            return lookup(path) != nullptr;
+        }
+
+        int handleRequest(struct MHD_Connection* connection,
+                          const char* url, const char* method, const char* upload_data,
+                          size_t* upload_data_size, void** ptr) override {
+
+            auto const* r = lookup(url);
+            if(not r or not r->ok) {
+                return MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, not_found_);
+            }
+
+            auto const* inm = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+            if(inm and std::string_view(inm).find(r->etag) != std::string_view::npos) {
+                return MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, r->not_modified);
+            }
+
+            return MHD_queue_response(connection, MHD_HTTP_OK, r->ok);
+        }
+
+    private:
+        struct responses_t {
+            std::string etag;
+            MHD_Response* ok = nullptr;
+            MHD_Response* not_modified = nullptr;
+        };
+
+        static responses_t create_responses(EmbeddedResource const& r) {
+            responses_t ret;
+
+            std::stringstream etag;
+            etag << "\"" << std::hex << fnv1a(std::string_view(reinterpret_cast<const char*>(r.data), r.size)) << "\"";
+            ret.etag = etag.str();
+
+            ret.ok = MHD_create_response_from_buffer(r.size, (void*) r.data, MHD_RESPMEM_PERSISTENT);
+            if(ret.ok) {
+                MHD_add_response_header(ret.ok, MHD_HTTP_HEADER_CONTENT_TYPE, std::string(mime_type(r.path)).c_str());
+                MHD_add_response_header(ret.ok, MHD_HTTP_HEADER_ETAG, ret.etag.c_str());
+            }
+
+            ret.not_modified = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+            if(ret.not_modified)
+                MHD_add_response_header(ret.not_modified, MHD_HTTP_HEADER_ETAG, ret.etag.c_str());
+
+            return ret;
+        }
+
+        responses_t const* lookup(std::string_view path) const {
+            if(path.compare(0, prefix_.size(), prefix_) != 0)
+                return nullptr;
+
+            // table paths are stored with leading slash
+            path.remove_prefix(prefix_.size() - (prefix_.empty() or prefix_.back() != '/' ? 0 : 1));
+
+            auto const* end = table_ + count_;
+            auto const* it = std::lower_bound(table_, end, path, [](auto const& e, std::string_view p) {
+                return e.path < p;
+            });
+            if(it == end or it->path != path)
+                return nullptr;
+
+            return &responses_[it - table_];
+        }
+
+        EmbeddedResource const* table_;
+        size_t count_;
+        std::string prefix_;
+        std::vector<responses_t> responses_;
+        MHD_Response* not_found_ = nullptr;
+    };
+}
+#endif //LMHTTPD_EMBED_HPP
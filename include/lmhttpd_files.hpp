@@ -0,0 +1,647 @@
+/*
+ *
+Copyright (c) 2021, Ales Stibal <astib@mag0.net>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+        modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+        IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+        FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+        DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+        SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+        CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#ifndef LMHTTPD_FILES_HPP
+#define LMHTTPD_FILES_HPP
+
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+#include <lmhttpd.hpp>
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace lmh {
+
+/**
+ * Bounded LRU cache of open file descriptors and their stat results, keyed by path.
+ * Small files are also kept in memory, within byte budget. Entries are invalidated
+ * by inotify events on their directories, not by stat on every request.
+ *
+ * Entries are refcounted: an entry removed from the cache stays valid as long as a handle
+ * (or a response created from it) is alive.
+ */
+    class FileCache {
+    public:
+        struct options_t {
+            size_t max_entries = 256;               // every entry not in memory holds one fd
+            size_t memory_budget = 16 * 1024 * 1024;
+            size_t small_file_limit = 64 * 1024;    // files up to this size are read into memory
+        };
+
+        struct Entry {
+            Entry() = default;
+            Entry(Entry const&) = delete;
+            Entry& operator=(Entry const&) = delete;
+            ~Entry() { if(fd >= 0) ::close(fd); }
+
+            std::string path;
+            struct stat st{};
+            int fd = -1;
+            bool in_memory = false;
+            std::string content;
+            std::string etag;
+        };
+        using handle_t = std::shared_ptr<Entry const>;
+
+        FileCache() : FileCache(options_t()) {}
+        explicit FileCache(options_t const& o) : options_(o) {
+            inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+            if(inotify_fd_ >= 0 and stop_fd_ >= 0)
+                watcher_ = std::thread([this]() { watch(); });
+        }
+
+        FileCache(FileCache const&) = delete;
+        FileCache& operator=(FileCache const&) = delete;
+
+        ~FileCache() {
+            if(watcher_.joinable()) {
+                uint64_t one = 1;
+                [[maybe_unused]] auto w = ::write(stop_fd_, &one, sizeof(one));
+                watcher_.join();
+            }
+            if(inotify_fd_ >= 0) ::close(inotify_fd_);
+            if(stop_fd_ >= 0) ::close(stop_fd_);
+        }
+
+        options_t const& options() const { return options_; }
+
+        /**
+         * Returns cached entry for regular file at path, opening it on miss. Null if it can't be opened.
+         */
+        handle_t get(std::string const& path) {
+            {
+                auto l_ = std::lock_guard(lock_);
+                auto it = index_.find(path);
+                if(it != index_.end()) {
+                    lru_.splice(lru_.begin(), lru_, it->second);
+                    return *it->second;
+                }
+                // change reported while we open and read the file makes what we get stale
+                ++loading_[path].loaders;
+            }
+
+            // without inotify we can't tell when entry gets stale, don't cache at all
+            bool const cacheable = watcher_.joinable() and watch_dir(path);
+            auto e = load(path, cacheable);
+
+            auto l_ = std::lock_guard(lock_);
+            auto ld = loading_.find(path);
+            bool const invalidated = ld->second.invalidated;
+            if(--ld->second.loaders == 0) loading_.erase(ld);
+
+            if(not e or not cacheable or invalidated) return e;
+
+            // someone else could be faster
+            auto it = index_.find(path);
+            if(it != index_.end()) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                return *it->second;
+            }
+
+            lru_.push_front(e);
+            index_[path] = lru_.begin();
+            if(e->in_memory) memory_used_ += e->content.size();
+            shrink();
+
+            return e;
+        }
+
+        /**
+         * Creates response for the whole file. In-memory content is not copied, response holds a reference
+         * to the entry instead. File responses get their own dup()-ed descriptor, so the cached one can be closed
+         * on eviction while libmicrohttpd is still sending from it.
+         */
+        static MHD_Response* create_response(handle_t const& e) {
+            if(not e) return nullptr;
+            return create_response(e, { 0, static_cast<uint64_t>(e->st.st_size) - 1 });
+        }
+
+        /**
+         * Creates response for part of the file, same rules as for the whole file apply.
+         */
+        static MHD_Response* create_response(handle_t const& e, ByteRange const& r) {
+            if(not e) return nullptr;
+
+            auto const length = e->st.st_size == 0 ? 0 : r.length();
+
+            if(e->in_memory) {
+#if MHD_VERSION >= 0x00097400
+                MHD_IoVec iov { e->content.data() + r.first, static_cast<size_t>(length) };
+                auto* keep = new handle_t(e);
+                auto* response = MHD_create_response_from_iovec(&iov, 1, &release_handle, keep);
+                if(not response) delete keep;
+                return response;
+#else
+                return MHD_create_response_from_buffer(length, (void*) (e->content.data() + r.first), MHD_RESPMEM_MUST_COPY);
+#endif
+            }
+
+            auto fd = ::fcntl(e->fd, F_DUPFD_CLOEXEC, 0);
+            if(fd < 0) return nullptr;
+
+            auto* response = MHD_create_response_from_fd_at_offset64(length, fd, r.first);
+            if(not response) ::close(fd);
+            return response;
+        }
+
+        void invalidate(std::string const& path) {
+            auto l_ = std::lock_guard(lock_);
+            forget(path);
+        }
+
+        void clear() {
+            auto l_ = std::lock_guard(lock_);
+            index_.clear();
+            lru_.clear();
+            memory_used_ = 0;
+            for(auto& [_, ld]: loading_) ld.invalidated = true;
+        }
+
+        size_t size() const {
+            auto l_ = std::lock_guard(lock_);
+            return lru_.size();
+        }
+
+        size_t memory_used() const {
+            auto l_ = std::lock_guard(lock_);
+            return memory_used_;
+        }
+
+    private:
+        using lru_t = std::list<handle_t>;
+
+        static void release_handle(void* cls) {
+            delete static_cast<handle_t*>(cls);
+        }
+
+        static bool read_all(int fd, char* buf, size_t size) {
+            size_t done = 0;
+            while(done < size) {
+                auto r = ::pread(fd, buf + done, size - done, static_cast<off_t>(done));
+                if(r < 0 and errno == EINTR) continue;
+                if(r <= 0) return false;
+                done += static_cast<size_t>(r);
+            }
+            return true;
+        }
+
+        // must be called locked
+        void drop(lru_t::iterator it) {
+            auto const& e = *it;
+            if(e->in_memory) memory_used_ -= e->content.size();
+            index_.erase(e->path);
+            lru_.erase(it);
+        }
+
+        // opens and stats regular file at path, small cacheable one is read into memory
+        std::shared_ptr<Entry> load(std::string const& path, bool cacheable) const {
+            auto e = std::make_shared<Entry>();
+            e->path = path;
+            e->fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if(e->fd < 0) return nullptr;
+
+            if(fstat(e->fd, &e->st) != 0 or not S_ISREG(e->st.st_mode))
+                return nullptr;
+
+            std::stringstream etag;
+            etag << "\"" << std::hex << e->st.st_ino << "-" << e->st.st_size << "-"
+                 << e->st.st_mtim.tv_sec << "." << e->st.st_mtim.tv_nsec << "\"";
+            e->etag = etag.str();
+
+            auto const size = static_cast<size_t>(e->st.st_size);
+            if(cacheable and size <= options_.small_file_limit and size <= options_.memory_budget) {
+                e->content.resize(size);
+                if(read_all(e->fd, e->content.data(), size)) {
+                    e->in_memory = true;
+                    ::close(e->fd);
+                    e->fd = -1;
+                }
+                else {
+                    e->content.clear();
+                }
+            }
+            return e;
+        }
+
+        // must be called locked; entry of path being loaded right now won't be cached either
+        void forget(std::string const& path) {
+            auto it = index_.find(path);
+            if(it != index_.end()) drop(it->second);
+
+            auto ld = loading_.find(path);
+            if(ld != loading_.end()) ld->second.invalidated = true;
+        }
+
+        // must be called locked
+        void shrink() {
+            while(not lru_.empty() and (lru_.size() > options_.max_entries or memory_used_ > options_.memory_budget)) {
+                drop(std::prev(lru_.end()));
+            }
+        }
+
+        bool watch_dir(std::string const& path) {
+            auto const slash = path.rfind('/');
+            auto const dir = slash == std::string::npos ? std::string(".") :
+                             slash == 0 ? std::string("/") : path.substr(0, slash);
+
+            // directory watch sees atomic replacements (rename over file) too
+            auto wd = inotify_add_watch(inotify_fd_, dir.c_str(),
+                                        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+                                        IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+            if(wd < 0) return false;
+
+            auto l_ = std::lock_guard(lock_);
+            watched_dirs_[wd] = dir;
+            return true;
+        }
+
+        void watch() {
+            alignas(inotify_event) char buf[4096];
+
+            while(true) {
+                pollfd fds[2] = { { inotify_fd_, POLLIN, 0 }, { stop_fd_, POLLIN, 0 } };
+                if(poll(fds, 2, -1) < 0) {
+                    if(errno == EINTR) continue;
+                    break;
+                }
+                if(fds[1].revents) break;
+
+                while(true) {
+                    auto len = ::read(inotify_fd_, buf, sizeof(buf));
+                    if(len <= 0) break;
+
+                    for(char* p = buf; p < buf + len; ) {
+                        auto const* ev = reinterpret_cast<inotify_event const*>(p);
+                        p += sizeof(inotify_event) + ev->len;
+                        on_event(ev);
+                    }
+                }
+            }
+        }
+
+        void on_event(inotify_event const* ev) {
+            if(ev->mask & IN_Q_OVERFLOW) {
+                clear();
+                return;
+            }
+
+            auto l_ = std::lock_guard(lock_);
+            auto d = watched_dirs_.find(ev->wd);
+            if(d == watched_dirs_.end()) return;
+
+            auto const dir = d->second == "/" ? std::string() : d->second;
+
+            if(ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                // directory is gone, so are all files cached from it
+                auto const prefix = dir + "/";
+                for(auto it = lru_.begin(); it != lru_.end(); ) {
+                    auto cur = it++;
+                    if((*cur)->path.compare(0, prefix.size(), prefix) == 0 and
+                        (*cur)->path.find('/', prefix.size()) == std::string::npos)
+                        drop(cur);
+                }
+                for(auto& [path, ld]: loading_) {
+                    if(path.compare(0, prefix.size(), prefix) == 0 and path.find('/', prefix.size()) == std::string::npos)
+                        ld.invalidated = true;
+                }
+                if(ev->mask & IN_IGNORED) watched_dirs_.erase(d);
+                return;
+            }
+
+            if(ev->len > 0) forget(dir + "/" + ev->name);
+        }
+
+        options_t options_;
+
+        mutable std::mutex lock_;
+        lru_t lru_;
+        std::unordered_map<std::string, lru_t::iterator> index_;
+        size_t memory_used_ = 0;
+
+        // paths get() is opening and reading, invalidated meanwhile are not cached
+        struct loading_t {
+            size_t loaders = 0;
+            bool invalidated = false;
+        };
+        std::unordered_map<std::string, loading_t> loading_;
+
+        std::unordered_map<int, std::string> watched_dirs_;
+        int inotify_fd_ = -1;
+        int stop_fd_ = -1;
+        std::thread watcher_;
+    };
+
+/**
+ * Streams multipart/byteranges body straight from cached file, parts are read into libmicrohttpd's
+ * buffer on demand - nothing is buffered upfront.
+ */
+    class ByteRangesReader {
+    public:
+        ByteRangesReader(FileCache::handle_t entry, std::vector<ByteRange> const& ranges, std::string const& content_type)
+            : entry_(std::move(entry)) {
+
+            boundary_ = boundary(entry_->etag);
+            auto const size = std::to_string(entry_->st.st_size);
+
+            for(auto const& r: ranges) {
+                std::stringstream head;
+                head << "\r\n--" << boundary_ << "\r\n"
+                     << MHD_HTTP_HEADER_CONTENT_TYPE << ": " << content_type << "\r\n"
+                     << MHD_HTTP_HEADER_CONTENT_RANGE << ": bytes " << r.first << "-" << r.last << "/" << size << "\r\n\r\n";
+
+                add_text(head.str());
+                chunks_.push_back({ {}, r.first, r.length() });
+                total_ += r.length();
+            }
+            add_text("\r\n--" + boundary_ + "--\r\n");
+        }
+
+        ByteRangesReader(ByteRangesReader const&) = delete;
+        ByteRangesReader& operator=(ByteRangesReader const&) = delete;
+        ~ByteRangesReader() { if(fd_ >= 0) ::close(fd_); }
+
+        std::string const& boundary() const { return boundary_; }
+        uint64_t size() const { return total_; }
+
+        /**
+         * Creates response which takes ownership of the reader.
+         */
+        static MHD_Response* create_response(std::unique_ptr<ByteRangesReader> reader) {
+            if(not reader->entry_->in_memory) {
+                reader->fd_ = ::fcntl(reader->entry_->fd, F_DUPFD_CLOEXEC, 0);
+                if(reader->fd_ < 0) return nullptr;
+            }
+
+            auto* response = MHD_create_response_from_callback(reader->size(), 64 * 1024,
+                                                               &ByteRangesReader::read, reader.get(),
+                                                               &ByteRangesReader::release);
+            if(response) reader.release();
+            return response;
+        }
+
+    private:
+        struct chunk_t {
+            std::string text;      // boundary and part headers
+            uint64_t offset = 0;   // otherwise file region
+            uint64_t length = 0;
+        };
+
+        void add_text(std::string text) {
+            total_ += text.size();
+            auto const len = text.size();
+            chunks_.push_back({ std::move(text), 0, len });
+        }
+
+        static std::string boundary(std::string const& seed) {
+            static std::atomic<uint64_t> counter = 0;
+            std::stringstream ss;
+            ss << "lmh" << std::hex << fnv1a(seed, fnv1a(std::to_string(counter++)));
+            return ss.str();
+        }
+
+        static ssize_t read(void* cls, uint64_t pos, char* buf, size_t max) {
+            return static_cast<ByteRangesReader*>(cls)->read_at(pos, buf, max);
+        }
+
+        static void release(void* cls) {
+            delete static_cast<ByteRangesReader*>(cls);
+        }
+
+        ssize_t read_at(uint64_t pos, char* buf, size_t max) {
+            if(pos >= total_) return MHD_CONTENT_READER_END_OF_STREAM;
+
+            // reads are sequential, remembered position makes it O(1)
+            if(pos < cur_start_) {
+                cur_ = 0;
+                cur_start_ = 0;
+            }
+            while(cur_ < chunks_.size() and pos >= cur_start_ + chunks_[cur_].length) {
+                cur_start_ += chunks_[cur_].length;
+                ++cur_;
+            }
+
+            size_t done = 0;
+            while(done < max and cur_ < chunks_.size()) {
+                auto const& c = chunks_[cur_];
+                auto const within = pos - cur_start_;
+                auto n = static_cast<size_t>(std::min<uint64_t>(c.length - within, max - done));
+
+                if(not c.text.empty()) {
+                    memcpy(buf + done, c.text.data() + within, n);
+                }
+                else if(entry_->in_memory) {
+                    memcpy(buf + done, entry_->content.data() + c.offset + within, n);
+                }
+                else {
+                    auto r = ::pread(fd_, buf + done, n, static_cast<off_t>(c.offset + within));
+                    if(r < 0 and errno == EINTR) continue;
+                    if(r <= 0) return done > 0 ? static_cast<ssize_t>(done) : MHD_CONTENT_READER_END_WITH_ERROR;
+                    n = static_cast<size_t>(r);
+                }
+
+                done += n;
+                pos += n;
+                if(within + n == c.length) {
+                    cur_start_ += c.length;
+                    ++cur_;
+                }
+            }
+            return static_cast<ssize_t>(done);
+        }
+
+        FileCache::handle_t entry_;
+        int fd_ = -1;
+        std::string boundary_;
+        std::vector<chunk_t> chunks_;
+        uint64_t total_ = 0;
+
+        size_t cur_ = 0;
+        uint64_t cur_start_ = 0;
+    };
+
+/**
+ * Serves files from directory, using FileCache for descriptors, metadata and small file content.
+ */
+    class FileController: public Controller {
+    public:
+        explicit FileController(std::string root, std::string prefix = "/",
+                                std::shared_ptr<FileCache> cache = std::make_shared<FileCache>())
+            : root_(std::move(root)), prefix_(std::move(prefix)), cache_(std::move(cache)) {
+
+            while(not root_.empty() and root_.back() == '/') root_.pop_back();
+        }
+
+        MethodSet methods() const override { return Method::GET | Method::HEAD; }
+
+        bool validRoute(const char* path, Method) override {
+            return std::string_view(path).compare(0, prefix_.size(), prefix_) == 0;
+        }
+
+        int handleRequest(struct MHD_Connection* connection,
+                          const char* url, const char* method, const char* upload_data,
+                          size_t* upload_data_size, void** ptr) override {
+
+            auto const file = file_path(url);
+            auto const entry = file.empty() ? nullptr : cache_->get(file);
+            if(not entry) {
+                auto* response = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+                auto ret = MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, response);
+                MHD_destroy_response(response);
+                return ret;
+            }
+
+            auto const* inm = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+            if(inm and std::string_view(inm).find(entry->etag) != std::string_view::npos) {
+                auto* response = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+                MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, entry->etag.c_str());
+                auto ret = MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, response);
+                MHD_destroy_response(response);
+                return ret;
+            }
+
+            auto const size = static_cast<uint64_t>(entry->st.st_size);
+            auto const content_type = std::string(mime_type(entry->path));
+
+            std::optional<std::vector<ByteRange>> ranges;
+            if(range_applies(connection, *entry)) {
+                ranges = parse_range(MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_RANGE), size);
+            }
+
+            MHD_Response* response = nullptr;
+            unsigned int status = MHD_HTTP_OK;
+
+            if(not ranges) {
+                response = file_response(connection, entry, { 0, size - 1 });
+                if(response)
+                    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, content_type.c_str());
+            }
+            else if(ranges->empty()) {
+                status = MHD_HTTP_RANGE_NOT_SATISFIABLE;
+                response = MHD_create_response_from_buffer(0, nullptr, MHD_RESPMEM_PERSISTENT);
+                if(response)
+                    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_RANGE, ("bytes */" + std::to_string(size)).c_str());
+            }
+            else if(ranges->size() == 1) {
+                status = MHD_HTTP_PARTIAL_CONTENT;
+                auto const& r = ranges->front();
+                response = file_response(connection, entry, r);
+                if(response) {
+                    std::stringstream cr;
+                    cr << "bytes " << r.first << "-" << r.last << "/" << size;
+                    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, content_type.c_str());
+                    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_RANGE, cr.str().c_str());
+                }
+            }
+            else {
+                status = MHD_HTTP_PARTIAL_CONTENT;
+                auto reader = std::make_unique<ByteRangesReader>(entry, *ranges, content_type);
+                auto const ct = "multipart/byteranges; boundary=" + reader->boundary();
+                response = ByteRangesReader::create_response(std::move(reader));
+                if(response)
+                    MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, ct.c_str());
+            }
+
+            if(not response) return MHD_NO;
+
+            MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, entry->etag.c_str());
+            MHD_add_response_header(response, MHD_HTTP_HEADER_LAST_MODIFIED, http_date(entry->st.st_mtim.tv_sec).c_str());
+            MHD_add_response_header(response, MHD_HTTP_HEADER_ACCEPT_RANGES, "bytes");
+
+            auto ret = MHD_queue_response(connection, status, response);
+            MHD_destroy_response(response);
+            return ret;
+        }
+
+        std::shared_ptr<FileCache> const& cache() const { return cache_; }
+
+    protected:
+        /**
+         * Response with file content or its range, empty file has range { 0, -1 }. Overridden by other backends.
+         */
+        virtual MHD_Response* file_response(struct MHD_Connection* connection, FileCache::handle_t const& entry, ByteRange const& r) {
+            return FileCache::create_response(entry, r);
+        }
+
+        /**
+         * If-Range: ranges are served only if the file is still the same the client has part of.
+         */
+        static bool range_applies(struct MHD_Connection* connection, FileCache::Entry const& entry) {
+            auto const* if_range = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_RANGE);
+            if(not if_range) return true;
+
+            // weak validators never match, dates are compared exactly to whole seconds of mtime
+            if(if_range[0] == '"') return entry.etag == if_range;
+            if(if_range[0] == 'W' and if_range[1] == '/') return false;
+
+            return parse_http_date(if_range) == entry.st.st_mtim.tv_sec;
+        }
+
+        /**
+         * Maps url to file under root, empty if url is not acceptable.
+         */
+        std::string file_path(std::string_view url) const {
+            if(url.compare(0, prefix_.size(), prefix_) != 0) return {};
+            url.remove_prefix(prefix_.size());
+
+            // no way out of root
+            for(size_t pos = 0; pos <= url.size(); ) {
+                auto next = url.find('/', pos);
+                if(next == std::string_view::npos) next = url.size();
+                if(url.substr(pos, next - pos) == "..") return {};
+                pos = next + 1;
+            }
+
+            std::string ret;
+            ret.reserve(root_.size() + url.size() + 12);
+            ret.append(root_);
+            if(url.empty() or url.front() != '/') ret.push_back('/');
+            ret.append(url);
+            if(ret.back() == '/') ret.append("index.html");
+
+            return ret;
+        }
+
+        std::string root_;
+        std::string prefix_;
+        std::shared_ptr<FileCache> cache_;
+    };
+}
+#endif //LMHTTPD_FILES_HPP
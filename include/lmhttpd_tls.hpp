@@ -0,0 +1,159 @@
+/*
+ *
+Copyright (c) 2021, Ales Stibal <astib@mag0.net>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+        modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+        IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+        FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+        DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+        SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+        CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#ifndef LMHTTPD_TLS_HPP
+#define LMHTTPD_TLS_HPP
+
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+#include <lmhttpd.hpp>
+
+namespace lmh {
+
+/**
+ * Mutual TLS: request is authenticated by client certificate verified against options_t::client_ca.
+ * Certificate is verified and parsed once per connection (TLS session) and kept in ConnectionContext,
+ * keep-alive requests reuse it.
+ *
+ * Identity subject is certificate subject DN. Claims: "issuer", "serial" (hex), and one claim per
+ * subject alternative name - "san.dns", "san.uri" (SPIFFE ids), "san.email", "san.ip".
+ */
+    class ClientCertAuthenticator: public Authenticator {
+    public:
+        // additional check of verified identity, ie. allowed SPIFFE ids
+        using filter_t = std::function<bool(Identity const&)>;
+
+        ClientCertAuthenticator() = default;
+        explicit ClientCertAuthenticator(filter_t filter) : filter_(std::move(filter)) {}
+
+        std::shared_ptr<Identity const> authenticate(struct MHD_Connection* connection) override {
+            auto* ctx = ConnectionContext::of(connection);
+            if(ctx and ctx->tls_identity.has_value()) return accepted(*ctx->tls_identity);
+
+            auto identity = peer_identity(connection);
+            if(ctx) ctx->tls_identity = identity;
+            return accepted(identity);
+        }
+
+        unsigned int reject_status() const override { return MHD_HTTP_FORBIDDEN; }
+
+        /**
+         * Verified identity of TLS peer, null if there is no certificate or it doesn't verify.
+         */
+        static std::shared_ptr<Identity const> peer_identity(struct MHD_Connection* connection) {
+            auto const* ci = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_GNUTLS_SESSION);
+            if(not ci or not ci->tls_session) return nullptr;
+            auto session = static_cast<gnutls_session_t>(ci->tls_session);
+
+            unsigned int status = 0;
+            if(gnutls_certificate_verify_peers2(session, &status) != GNUTLS_E_SUCCESS or status != 0)
+                return nullptr;
+
+            unsigned int count = 0;
+            auto const* certs = gnutls_certificate_get_peers(session, &count);
+            if(not certs or count == 0) return nullptr;
+
+            gnutls_x509_crt_t crt;
+            if(gnutls_x509_crt_init(&crt) != GNUTLS_E_SUCCESS) return nullptr;
+            if(gnutls_x509_crt_import(crt, &certs[0], GNUTLS_X509_FMT_DER) != GNUTLS_E_SUCCESS) {
+                gnutls_x509_crt_deinit(crt);
+                return nullptr;
+            }
+
+            auto identity = std::make_shared<Identity>();
+            identity->scheme = "mtls";
+
+            gnutls_datum_t dn{};
+            if(gnutls_x509_crt_get_dn2(crt, &dn) == GNUTLS_E_SUCCESS) {
+                identity->subject.assign(reinterpret_cast<const char*>(dn.data), dn.size);
+                gnutls_free(dn.data);
+            }
+            if(gnutls_x509_crt_get_issuer_dn2(crt, &dn) == GNUTLS_E_SUCCESS) {
+                identity->claims.emplace_back("issuer", std::string(reinterpret_cast<const char*>(dn.data), dn.size));
+                gnutls_free(dn.data);
+            }
+
+            unsigned char serial[64];
+            size_t serial_size = sizeof(serial);
+            if(gnutls_x509_crt_get_serial(crt, serial, &serial_size) == GNUTLS_E_SUCCESS) {
+                std::string hex;
+                for(size_t i = 0; i < serial_size; ++i) {
+                    constexpr const char* digits = "0123456789abcdef";
+                    hex += digits[serial[i] >> 4];
+                    hex += digits[serial[i] & 0xf];
+                }
+                identity->claims.emplace_back("serial", std::move(hex));
+            }
+
+            for(unsigned int i = 0; ; ++i) {
+                char san[512];
+                size_t san_size = sizeof(san);
+                auto const type = gnutls_x509_crt_get_subject_alt_name(crt, i, san, &san_size, nullptr);
+                if(type == GNUTLS_E_REQUESTED_DATA_NOT_AVAILABLE) break;
+                if(type < 0) continue;
+
+                switch(type) {
+                    case GNUTLS_SAN_DNSNAME:
+                        identity->claims.emplace_back("san.dns", std::string(san, san_size));
+                        break;
+                    case GNUTLS_SAN_URI:
+                        identity->claims.emplace_back("san.uri", std::string(san, san_size));
+                        break;
+                    case GNUTLS_SAN_RFC822NAME:
+                        identity->claims.emplace_back("san.email", std::string(san, san_size));
+                        break;
+                    case GNUTLS_SAN_IPADDRESS: {
+                        char ip[INET6_ADDRSTRLEN] = {};
+                        inet_ntop(san_size == 4 ? AF_INET : AF_INET6, san, ip, sizeof(ip));
+                        identity->claims.emplace_back("san.ip", ip);
+                        break;
+                    }
+                    default:
+                        break;
+                }
+            }
+
+            gnutls_x509_crt_deinit(crt);
+            return identity;
+        }
+
+    private:
+        std::shared_ptr<Identity const> accepted(std::shared_ptr<Identity const> const& identity) const {
+            if(not identity or (filter_ and not filter_(*identity))) return nullptr;
+            return identity;
+        }
+
+        filter_t filter_;
+    };
+}
+#endif //LMHTTPD_TLS_HPP
@@ -0,0 +1,693 @@
+/*
+ *
+Copyright (c) 2021, Ales Stibal <astib@mag0.net>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+        modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice,
+this list of conditions and the following disclaimer in the documentation
+and/or other materials provided with the distribution.
+
+3. Neither the name of the copyright holder nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+        IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+        FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+        DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+        SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+        CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#ifndef LMHTTPD_URING_HPP
+#define LMHTTPD_URING_HPP
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <poll.h>
+
+#include <lmhttpd_files.hpp>
+
+namespace lmh {
+
+/**
+ * Minimal io_uring for file reads, on raw syscalls. Reads are queued from any thread and submitted in batches
+ * by the ring thread, which is woken by poll on eventfd kept in the ring, and which also reaps completions.
+ * Buffers and files are registered with the kernel if it allows (RLIMIT_MEMLOCK, kernel version),
+ * otherwise the same buffers are read into by plain reads.
+ */
+    class IoRing {
+    public:
+        struct options_t {
+            unsigned int entries = 256;
+            size_t buffers = 64;
+            size_t buffer_size = 128 * 1024;
+            unsigned int files = 256;             // fixed file table slots
+        };
+
+        /**
+         * Receives result of read (bytes read or -errno), called from ring thread.
+         */
+        class Completion {
+        public:
+            virtual ~Completion() = default;
+            virtual void complete(int result) = 0;
+        };
+
+        IoRing() : IoRing(options_t()) {}
+        explicit IoRing(options_t o) : options_(o) {
+            if(not setup()) {
+                teardown();
+                return;
+            }
+            thread_ = std::thread([this]() { run(); });
+        }
+
+        IoRing(IoRing const&) = delete;
+        IoRing& operator=(IoRing const&) = delete;
+
+        ~IoRing() {
+            if(thread_.joinable()) {
+                {
+                    auto l_ = std::lock_guard(lock_);
+                    stop_ = true;
+                }
+                wake();
+                thread_.join();
+            }
+            teardown();
+        }
+
+        /**
+         * False if io_uring is not available (old kernel, seccomp), users fall back to other I/O.
+         */
+        bool valid() const { return thread_.joinable(); }
+
+        options_t const& options() const { return options_; }
+        bool fixed_buffers() const { return fixed_buffers_; }
+        bool fixed_files() const { return fixed_files_; }
+
+        /**
+         * Index of free buffer, -1 if all are taken.
+         */
+        int acquire_buffer() {
+            auto l_ = std::lock_guard(lock_);
+            if(free_buffers_.empty()) return -1;
+
+            auto const b = free_buffers_.back();
+            free_buffers_.pop_back();
+            return b;
+        }
+
+        void release_buffer(int b) {
+            auto l_ = std::lock_guard(lock_);
+            free_buffers_.push_back(b);
+        }
+
+        char* buffer(int b) const { return buffers_ + static_cast<size_t>(b) * options_.buffer_size; }
+
+        /**
+         * Installs fd into fixed file table, returns its slot or -1 (reads then use fd itself).
+         */
+        int register_file(int fd) {
+            if(not fixed_files_) return -1;
+
+            int slot = -1;
+            {
+                auto l_ = std::lock_guard(lock_);
+                if(free_files_.empty()) return -1;
+                slot = free_files_.back();
+                free_files_.pop_back();
+            }
+
+            if(update_file(slot, fd)) return slot;
+
+            release_file_slot(slot);
+            return -1;
+        }
+
+        void unregister_file(int slot) {
+            if(slot < 0) return;
+            update_file(slot, -1);
+            release_file_slot(slot);
+        }
+
+        /**
+         * Queues read of len bytes at offset into buffer, result is passed to c. Returns false if queue is full.
+         */
+        bool read(int fd, int slot, int buffer_index, uint64_t offset, unsigned int len, Completion* c) {
+            {
+                auto l_ = std::lock_guard(lock_);
+                auto* sqe = next_sqe();
+                if(stop_ or not sqe) return false;
+
+                if(fixed_buffers_) {
+                    sqe->opcode = IORING_OP_READ_FIXED;
+                    sqe->buf_index = static_cast<__u16>(buffer_index);
+                }
+                else {
+                    sqe->opcode = IORING_OP_READ;
+                }
+                if(slot >= 0) {
+                    sqe->fd = slot;
+                    sqe->flags = IOSQE_FIXED_FILE;
+                }
+                else {
+                    sqe->fd = fd;
+                }
+                sqe->off = offset;
+                sqe->addr = reinterpret_cast<uintptr_t>(buffer(buffer_index));
+                sqe->len = len;
+                sqe->user_data = reinterpret_cast<uintptr_t>(c);
+
+                commit_sqe();
+                ++in_flight_;
+            }
+            wake();
+            return true;
+        }
+
+        /**
+         * After read() refused for full queue: c is completed with 0 once the queue has room again
+         * (-ECANCELED if ring is stopping meanwhile). Returns false if ring is already stopping.
+         */
+        bool when_free(Completion* c) {
+            {
+                auto l_ = std::lock_guard(lock_);
+                if(stop_) return false;
+                waiting_.push_back(c);
+            }
+            wake();
+            return true;
+        }
+
+    private:
+        static int sys_setup(unsigned int entries, io_uring_params* p) {
+            return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+        }
+        int sys_enter(unsigned int to_submit, unsigned int min_complete, unsigned int flags) const {
+            return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags, nullptr, 0));
+        }
+        int sys_register(unsigned int op, void* arg, unsigned int n) const {
+            return static_cast<int>(syscall(__NR_io_uring_register, ring_fd_, op, arg, n));
+        }
+
+        bool setup() {
+            io_uring_params p{};
+            ring_fd_ = sys_setup(options_.entries, &p);
+            if(ring_fd_ < 0) return false;
+
+            sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+            cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+            bool const single = p.features & IORING_FEAT_SINGLE_MMAP;
+            if(single) sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+            sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+            if(sq_ring_ == MAP_FAILED) return false;
+            cq_ring_ = single ? sq_ring_
+                              : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+            if(cq_ring_ == MAP_FAILED) return false;
+
+            sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+            auto* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+            if(sqes == MAP_FAILED) return false;
+            sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+            auto* sq = static_cast<char*>(sq_ring_);
+            sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+            sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+            sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+            sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+            sq_entries_ = p.sq_entries;
+            sq_local_tail_ = *sq_tail_;
+
+            auto* cq = static_cast<char*>(cq_ring_);
+            cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+            cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+            cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+            buffers_size_ = options_.buffers * options_.buffer_size;
+            auto* buffers = mmap(nullptr, buffers_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(buffers == MAP_FAILED) return false;
+            buffers_ = static_cast<char*>(buffers);
+
+            // registered buffers are pinned once instead of on every read
+            std::vector<iovec> iov(options_.buffers);
+            for(size_t i = 0; i < iov.size(); ++i) {
+                iov[i] = { buffer(static_cast<int>(i)), options_.buffer_size };
+                free_buffers_.push_back(static_cast<int>(options_.buffers - 1 - i));
+            }
+            fixed_buffers_ = options_.buffer_size <= UINT32_MAX and
+                             sys_register(IORING_REGISTER_BUFFERS, iov.data(), static_cast<unsigned>(iov.size())) == 0;
+
+            // sparse table, slots are filled per response
+            std::vector<int> files(options_.files, -1);
+            fixed_files_ = not files.empty() and
+                           sys_register(IORING_REGISTER_FILES, files.data(), static_cast<unsigned>(files.size())) == 0;
+            for(unsigned int i = 0; fixed_files_ and i < options_.files; ++i)
+                free_files_.push_back(static_cast<int>(options_.files - 1 - i));
+
+            event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if(event_fd_ < 0) return false;
+
+            return arm_wake();
+        }
+
+        void teardown() {
+            if(buffers_) munmap(buffers_, buffers_size_);
+            if(sqes_) munmap(sqes_, sqes_size_);
+            if(cq_ring_ and cq_ring_ != MAP_FAILED and cq_ring_ != sq_ring_) munmap(cq_ring_, cq_ring_size_);
+            if(sq_ring_ and sq_ring_ != MAP_FAILED) munmap(sq_ring_, sq_ring_size_);
+            if(event_fd_ >= 0) ::close(event_fd_);
+            if(ring_fd_ >= 0) ::close(ring_fd_);
+
+            buffers_ = nullptr;
+            sqes_ = nullptr;
+            cq_ring_ = sq_ring_ = nullptr;
+            event_fd_ = ring_fd_ = -1;
+        }
+
+        bool update_file(int slot, int fd) {
+            io_uring_files_update upd{};
+            upd.offset = static_cast<__u32>(slot);
+            upd.fds = reinterpret_cast<uintptr_t>(&fd);
+            return sys_register(IORING_REGISTER_FILES_UPDATE, &upd, 1) == 1;
+        }
+
+        void release_file_slot(int slot) {
+            auto l_ = std::lock_guard(lock_);
+            free_files_.push_back(slot);
+        }
+
+        // must be called locked
+        io_uring_sqe* next_sqe() {
+            auto const head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+            if(sq_local_tail_ - head >= sq_entries_) return nullptr;
+
+            auto const idx = sq_local_tail_ & sq_mask_;
+            auto* sqe = &sqes_[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sq_array_[idx] = idx;
+            return sqe;
+        }
+
+        // must be called locked
+        void commit_sqe() {
+            ++sq_local_tail_;
+            __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+            ++pending_;
+        }
+
+        // must be called locked, or before ring thread runs
+        bool arm_wake() {
+            auto* sqe = next_sqe();
+            if(not sqe) return false;
+
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = event_fd_;
+            sqe->poll_events = POLLIN;
+            sqe->user_data = 0;
+            commit_sqe();
+
+            armed_ = true;
+            return true;
+        }
+
+        // one eventfd write per batch, ring thread submits everything queued since
+        void wake() {
+            if(not wake_pending_.exchange(true)) {
+                uint64_t one = 1;
+                [[maybe_unused]] auto w = ::write(event_fd_, &one, sizeof(one));
+            }
+        }
+
+        void run() {
+            while(true) {
+                unsigned int to_submit = 0;
+                bool wait = false;
+                {
+                    auto l_ = std::lock_guard(lock_);
+                    if(stop_ and in_flight_ == 0 and waiting_.empty()) return;
+
+                    // without armed wake-up poll the ring can't sleep
+                    if(not armed_) arm_wake();
+                    wait = armed_;
+
+                    to_submit = pending_;
+                    pending_ = 0;
+                }
+
+                auto const r = sys_enter(to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+
+                // not submitted entries stay in the queue
+                auto const submitted = r < 0 ? 0U : static_cast<unsigned int>(r);
+                if(submitted < to_submit) {
+                    auto l_ = std::lock_guard(lock_);
+                    pending_ += to_submit - submitted;
+                }
+                if(r < 0 and errno != EINTR and errno != EAGAIN and errno != EBUSY) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+
+                reap();
+                notify_waiting();
+            }
+        }
+
+        // entries queued so far are submitted, waiters for room in the queue may try again
+        void notify_waiting() {
+            std::vector<Completion*> ready;
+            bool stopping;
+            {
+                auto l_ = std::lock_guard(lock_);
+                stopping = stop_;
+                if(stopping or sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) < sq_entries_)
+                    ready.swap(waiting_);
+            }
+            for(auto* c: ready) c->complete(stopping ? -ECANCELED : 0);
+        }
+
+        void reap() {
+            auto head = *cq_head_;
+            auto const tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+
+            for(; head != tail; ++head) {
+                auto const& cqe = cqes_[head & cq_mask_];
+                auto const user_data = cqe.user_data;
+                auto const result = cqe.res;
+                __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+
+                if(user_data == 0) {
+                    uint64_t v = 0;
+                    [[maybe_unused]] auto rd = ::read(event_fd_, &v, sizeof(v));
+                    wake_pending_ = false;
+
+                    auto l_ = std::lock_guard(lock_);
+                    armed_ = false;
+                    arm_wake();
+                    continue;
+                }
+
+                {
+                    auto l_ = std::lock_guard(lock_);
+                    --in_flight_;
+                }
+                reinterpret_cast<Completion*>(user_data)->complete(result);
+            }
+        }
+
+        options_t options_;
+
+        int ring_fd_ = -1;
+        int event_fd_ = -1;
+        void* sq_ring_ = nullptr;
+        void* cq_ring_ = nullptr;
+        size_t sq_ring_size_ = 0;
+        size_t cq_ring_size_ = 0;
+        io_uring_sqe* sqes_ = nullptr;
+        size_t sqes_size_ = 0;
+
+        unsigned* sq_head_ = nullptr;
+        unsigned* sq_tail_ = nullptr;
+        unsigned* sq_array_ = nullptr;
+        unsigned sq_mask_ = 0;
+        unsigned sq_entries_ = 0;
+        unsigned sq_local_tail_ = 0;
+
+        unsigned* cq_head_ = nullptr;
+        unsigned* cq_tail_ = nullptr;
+        unsigned cq_mask_ = 0;
+        io_uring_cqe* cqes_ = nullptr;
+
+        char* buffers_ = nullptr;
+        size_t buffers_size_ = 0;
+        bool fixed_buffers_ = false;
+        bool fixed_files_ = false;
+
+        std::mutex lock_;
+        std::vector<int> free_buffers_;
+        std::vector<int> free_files_;
+        std::vector<Completion*> waiting_;      // see when_free()
+        unsigned int pending_ = 0;
+        size_t in_flight_ = 0;
+        bool armed_ = false;
+        bool stop_ = false;
+
+        std::atomic<bool> wake_pending_ = false;
+        std::thread thread_;
+    };
+
+/**
+ * Callback response body read by IoRing. Two buffers are kept in flight ahead of libmicrohttpd; when it asks
+ * for data not read yet, connection is suspended and resumed by the ring thread once the read completes.
+ * Nothing blocks daemon thread, even for files not in page cache.
+ */
+    class UringFileStream: public std::enable_shared_from_this<UringFileStream> {
+    public:
+        /**
+         * Response for range of cached file, null if ring has no free buffers (caller falls back to other I/O).
+         */
+        static MHD_Response* create_response(std::shared_ptr<IoRing> const& ring, struct MHD_Connection* connection,
+                                             FileCache::handle_t const& entry, ByteRange const& r) {
+            auto const length = entry->st.st_size == 0 ? 0 : r.length();
+            if(not ring or not ring->valid() or entry->fd < 0 or length == 0) return nullptr;
+
+            auto stream = std::shared_ptr<UringFileStream>(new UringFileStream(ring, connection, entry, r.first, length));
+            if(stream->bufs_[0].index < 0) return nullptr;
+
+            {
+                // ring queue is full, caller falls back; read-ahead buffer is retried once the first read completes
+                auto l_ = std::lock_guard(stream->lock_);
+                if(not stream->issue(stream->bufs_[0])) return nullptr;
+                stream->issue(stream->bufs_[1]);
+            }
+
+            auto* holder = new std::shared_ptr<UringFileStream>(stream);
+            auto* response = MHD_create_response_from_callback(length, ring->options().buffer_size,
+                                                               &UringFileStream::read, holder,
+                                                               &UringFileStream::release);
+            if(not response) delete holder;
+            return response;
+        }
+
+        UringFileStream(UringFileStream const&) = delete;
+        UringFileStream& operator=(UringFileStream const&) = delete;
+
+        ~UringFileStream() {
+            for(auto const& b: bufs_)
+                if(b.index >= 0) ring_->release_buffer(b.index);
+            ring_->unregister_file(slot_);
+        }
+
+    private:
+        enum class state_t { EMPTY, READING, READY };
+
+        struct buffer_t: public IoRing::Completion {
+            UringFileStream* stream = nullptr;
+            int index = -1;
+            state_t state = state_t::EMPTY;
+            uint64_t pos = 0;         // position in stream
+            size_t length = 0;
+
+            void complete(int result) override { stream->completed(*this, result); }
+        };
+
+        struct retry_t: public IoRing::Completion {
+            UringFileStream* stream = nullptr;
+
+            void complete(int result) override { stream->retried(result); }
+        };
+
+        UringFileStream(std::shared_ptr<IoRing> ring, struct MHD_Connection* connection, FileCache::handle_t entry,
+                        uint64_t offset, uint64_t length)
+            : ring_(std::move(ring)), connection_(connection), entry_(std::move(entry)), offset_(offset), total_(length) {
+
+            for(auto& b: bufs_) {
+                b.stream = this;
+                b.index = ring_->acquire_buffer();
+            }
+            retry_.stream = this;
+            // one buffer is enough, just without read-ahead
+            if(bufs_[0].index < 0) std::swap(bufs_[0].index, bufs_[1].index);
+
+            slot_ = ring_->register_file(entry_->fd);
+        }
+
+        static ssize_t read(void* cls, uint64_t pos, char* buf, size_t max) {
+            return (*static_cast<std::shared_ptr<UringFileStream>*>(cls))->read_at(pos, buf, max);
+        }
+
+        static void release(void* cls) {
+            delete static_cast<std::shared_ptr<UringFileStream>*>(cls);
+        }
+
+        // must be called locked, false if ring queue is full (buffer stays empty)
+        bool issue(buffer_t& b) {
+            if(b.index < 0 or next_ >= total_) return true;
+
+            b.pos = next_;
+            b.length = static_cast<size_t>(std::min<uint64_t>(ring_->options().buffer_size, total_ - next_));
+            b.state = state_t::READING;
+            next_ += b.length;
+
+            // stream lives while reads into its buffers are in flight, even if response is gone
+            if(reads_++ == 0) self_ = shared_from_this();
+
+            if(not ring_->read(entry_->fd, slot_, b.index, offset_ + b.pos, static_cast<unsigned int>(b.length), &b)) {
+                b.state = state_t::EMPTY;
+                next_ = b.pos;
+                // callers hold their own reference
+                if(--reads_ == 0) self_.reset();
+                return false;
+            }
+            return true;
+        }
+
+        // must be called locked; reads into empty buffers, what doesn't fit into ring queue waits for room in it
+        void issue_empty() {
+            for(auto& b: bufs_) {
+                if(b.state != state_t::EMPTY or issue(b)) continue;
+
+                if(not retry_pending_) {
+                    if(not ring_->when_free(&retry_)) {
+                        failed_ = true;
+                        return;
+                    }
+                    retry_pending_ = true;
+                    if(reads_++ == 0) self_ = shared_from_this();
+                }
+                return;
+            }
+        }
+
+        ssize_t read_at(uint64_t pos, char* buf, size_t max) {
+            auto l_ = std::lock_guard(lock_);
+
+            if(pos >= total_) return MHD_CONTENT_READER_END_OF_STREAM;
+            if(failed_) return MHD_CONTENT_READER_END_WITH_ERROR;
+
+            for(auto& b: bufs_) {
+                if(b.state != state_t::READY or pos < b.pos or pos >= b.pos + b.length) continue;
+
+                auto const within = static_cast<size_t>(pos - b.pos);
+                auto const n = std::min(max, b.length - within);
+                memcpy(buf, ring_->buffer(b.index) + within, n);
+
+                if(within + n == b.length) {
+                    b.state = state_t::EMPTY;
+                    issue_empty();
+                }
+                return static_cast<ssize_t>(n);
+            }
+
+            issue_empty();
+            if(failed_) return MHD_CONTENT_READER_END_WITH_ERROR;
+
+            // read is on the way, suspending under the lock so completion can't resume before
+            suspended_ = true;
+            suspend_connection(connection_);
+            return 0;
+        }
+
+        void completed(buffer_t& b, int result) {
+            std::shared_ptr<UringFileStream> keep;
+            auto l_ = std::lock_guard(lock_);
+
+            if(result < 0 or static_cast<size_t>(result) != b.length) {
+                // file got truncated under us or read failed
+                failed_ = true;
+                b.state = state_t::EMPTY;
+            }
+            else {
+                b.state = state_t::READY;
+                // queue has room now, read-ahead which didn't fit goes in
+                issue_empty();
+            }
+
+            if(--reads_ == 0) keep = std::move(self_);
+
+            if(suspended_) {
+                suspended_ = false;
+                resume_connection(connection_);
+            }
+        }
+
+        void retried(int result) {
+            std::shared_ptr<UringFileStream> keep;
+            auto l_ = std::lock_guard(lock_);
+
+            retry_pending_ = false;
+            if(result < 0)
+                failed_ = true;
+            else
+                issue_empty();
+
+            if(--reads_ == 0) keep = std::move(self_);
+
+            if(suspended_) {
+                suspended_ = false;
+                resume_connection(connection_);
+            }
+        }
+
+        std::shared_ptr<IoRing> ring_;
+        struct MHD_Connection* connection_;
+        FileCache::handle_t entry_;
+        uint64_t offset_;
+        uint64_t total_;
+        int slot_ = -1;
+
+        std::mutex lock_;
+        std::array<buffer_t, 2> bufs_;
+        retry_t retry_;
+        uint64_t next_ = 0;               // stream position of next read
+        unsigned int reads_ = 0;          // reads in flight, and pending retry
+        bool retry_pending_ = false;
+        bool suspended_ = false;
+        bool failed_ = false;
+        std::shared_ptr<UringFileStream> self_;
+    };
+
+/**
+ * FileController reading files not kept in memory through io_uring, instead of sendfile() which blocks
+ * daemon thread on page cache misses. Falls back to FileController responses if io_uring is not available.
+ */
+    class UringFileController: public FileController {
+    public:
+        explicit UringFileController(std::string root, std::string prefix = "/",
+                                     std::shared_ptr<FileCache> cache = std::make_shared<FileCache>(),
+                                     std::shared_ptr<IoRing> ring = std::make_shared<IoRing>())
+            : FileController(std::move(root), std::move(prefix), std::move(cache)), ring_(std::move(ring)) {}
+
+        bool suspends() const override { return ring_ and ring_->valid(); }
+
+        std::shared_ptr<IoRing> const& ring() const { return ring_; }
+
+    protected:
+        MHD_Response* file_response(struct MHD_Connection* connection, FileCache::handle_t const& entry, ByteRange const& r) override {
+            if(not entry->in_memory) {
+                if(auto* response = UringFileStream::create_response(ring_, connection, entry, r); response)
+                    return response;
+            }
+            return FileController::file_response(connection, entry, r);
+        }
+
+        std::shared_ptr<IoRing> ring_;
+    };
+}
+#endif //LMHTTPD_URING_HPP
@@ -0,0 +1,157 @@
+//
+// Packs directory of assets into single indexed bundle served by lmh::BundleController.
+//
+// usage: lmh_bundle <asset-directory> <output-bundle>
+//
+// Precompressed siblings (file.gz, file.br) are stored as variants of file and are not served on their own.
+// Directory index.html is also reachable by the directory path ("/docs/" serves "/docs/index.html").
+//
+
+#include <lmhttpd_bundle.hpp>
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+
+namespace fs = std::filesystem;
+using namespace lmh;
+
+namespace {
+
+    struct Source {
+        std::string content_type;
+        std::string etag;
+        std::string variants[bundle::VARIANT_COUNT];
+    };
+
+    bool read_file(fs::path const& p, std::string& out) {
+        std::ifstream f(p, std::ios::binary);
+        if(not f) return false;
+
+        out.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+        return not f.bad();
+    }
+
+    bool has_variant_suffix(std::string const& name) {
+        for(unsigned v = 1; v < bundle::VARIANT_COUNT; ++v) {
+            auto const& sfx = bundle::variant_suffix[v];
+            if(name.size() > sfx.size() and name.compare(name.size() - sfx.size(), sfx.size(), sfx) == 0)
+                return true;
+        }
+        return false;
+    }
+}
+
+int main(int argc, char** argv) {
+
+    if(argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <asset-directory> <output-bundle>\n";
+        return 1;
+    }
+
+    fs::path const root(argv[1]);
+    std::error_code ec;
+    if(not fs::is_directory(root, ec)) {
+        std::cerr << "not a directory: " << root << "\n";
+        return 1;
+    }
+
+    // std::map keeps paths sorted, as the index requires
+    std::map<std::string, std::shared_ptr<Source>> sources;
+
+    for(auto const& de: fs::recursive_directory_iterator(root)) {
+        if(not de.is_regular_file()) continue;
+
+        auto const rel = "/" + fs::relative(de.path(), root).generic_string();
+        auto const& p = de.path();
+
+        // variant of existing file is picked up together with the file
+        if(has_variant_suffix(rel)) {
+            auto base = p;
+            base.replace_extension();
+            if(fs::is_regular_file(base)) continue;
+        }
+
+        auto src = std::make_shared<Source>();
+        if(not read_file(p, src->variants[bundle::IDENTITY])) {
+            std::cerr << "cannot read " << p << "\n";
+            return 1;
+        }
+        for(unsigned v = 1; v < bundle::VARIANT_COUNT; ++v) {
+            auto vp = p;
+            vp += std::string(bundle::variant_suffix[v]);
+            if(fs::is_regular_file(vp) and not read_file(vp, src->variants[v])) {
+                std::cerr << "cannot read " << vp << "\n";
+                return 1;
+            }
+        }
+
+        src->content_type = mime_type(rel);
+
+        std::stringstream etag;
+        etag << "\"" << std::hex << fnv1a(src->variants[bundle::IDENTITY]) << "\"";
+        src->etag = etag.str();
+
+        sources[rel] = src;
+
+        constexpr std::string_view index_html = "index.html";
+        if(rel.size() >= index_html.size() and rel.compare(rel.size() - index_html.size(), index_html.size(), index_html) == 0
+           and rel[rel.size() - index_html.size() - 1] == '/') {
+            sources[rel.substr(0, rel.size() - index_html.size())] = src;
+        }
+    }
+
+    // layout: header | index | data
+    std::vector<bundle::BundleEntry> index(sources.size());
+    std::string data;
+
+    uint64_t const data_offset = sizeof(bundle::BundleHeader) + index.size() * sizeof(bundle::BundleEntry);
+
+    auto put = [&](std::string const& s, bool terminate) {
+        bundle::Ref r{ data_offset + data.size(), s.size() };
+        data.append(s);
+        if(terminate) data.push_back('\0');
+        return r;
+    };
+
+    // aliases share data with their original entry
+    std::map<Source const*, bundle::BundleEntry> written;
+
+    size_t i = 0;
+    for(auto const& [path, src]: sources) {
+        auto& e = index[i++];
+
+        auto w = written.find(src.get());
+        if(w != written.end()) {
+            e = w->second;
+        }
+        else {
+            e.content_type = put(src->content_type, true);
+            e.etag = put(src->etag, true);
+            for(unsigned v = 0; v < bundle::VARIANT_COUNT; ++v)
+                e.variants[v] = put(src->variants[v], false);
+            written[src.get()] = e;
+        }
+        e.path = put(path, true);
+    }
+
+    bundle::BundleHeader hdr{};
+    memcpy(hdr.magic, bundle::magic, sizeof(hdr.magic));
+    hdr.version = bundle::version;
+    hdr.count = static_cast<uint32_t>(index.size());
+    hdr.index_offset = sizeof(bundle::BundleHeader);
+
+    std::ofstream out(argv[2], std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+    out.write(reinterpret_cast<const char*>(index.data()), static_cast<std::streamsize>(index.size() * sizeof(bundle::BundleEntry)));
+    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+    out.close();
+
+    if(not out) {
+        std::cerr << "cannot write " << argv[2] << "\n";
+        return 1;
+    }
+
+    std::cout << "bundled " << index.size() << " entries, " << data.size() << " bytes\n";
+    return 0;
+}
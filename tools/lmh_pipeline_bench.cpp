@@ -0,0 +1,158 @@
+//
+// HTTP/1.1 pipelining benchmark: every connection writes <depth> GET requests at once and reads all responses.
+//
+// usage: lmh_pipeline_bench <host> <port> <path> [connections=4] [depth=16] [seconds=10]
+//
+// Prints requests per second and how many requests were carried by one write()/read() on the client side.
+// Server side syscalls can be counted alongside, ie. with "strace -c -f -p <pid>".
+//
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+    struct stats_t {
+        uint64_t requests = 0;
+        uint64_t writes = 0;
+        uint64_t reads = 0;
+        bool failed = false;
+    };
+
+    // returns number of complete responses at the beginning of buf, consumed bytes are erased
+    size_t take_responses(std::string& buf) {
+        size_t count = 0;
+        size_t pos = 0;
+
+        while(true) {
+            auto const hdr_end = buf.find("\r\n\r\n", pos);
+            if(hdr_end == std::string::npos) break;
+
+            size_t length = 0;
+            auto const cl = buf.find("Content-Length:", pos);
+            if(cl != std::string::npos and cl < hdr_end) {
+                length = std::stoul(buf.substr(cl + 15, hdr_end - cl - 15));
+            }
+
+            auto const end = hdr_end + 4 + length;
+            if(end > buf.size()) break;
+
+            pos = end;
+            ++count;
+        }
+
+        buf.erase(0, pos);
+        return count;
+    }
+
+    void run(sockaddr_in const& addr, std::string const& batch, unsigned depth,
+             std::atomic<bool> const& stop, stats_t& st) {
+
+        auto fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd < 0 or connect(fd, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) != 0) {
+            st.failed = true;
+            if(fd >= 0) close(fd);
+            return;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::string buf;
+        std::vector<char> chunk(64 * 1024);
+
+        while(not stop) {
+            if(write(fd, batch.data(), batch.size()) != static_cast<ssize_t>(batch.size())) {
+                st.failed = true;
+                break;
+            }
+            ++st.writes;
+
+            unsigned pending = depth;
+            while(pending > 0) {
+                auto r = read(fd, chunk.data(), chunk.size());
+                if(r <= 0) {
+                    st.failed = true;
+                    break;
+                }
+                ++st.reads;
+
+                buf.append(chunk.data(), static_cast<size_t>(r));
+                auto const got = take_responses(buf);
+                pending -= std::min<unsigned>(pending, static_cast<unsigned>(got));
+                st.requests += got;
+            }
+            if(st.failed) break;
+        }
+        close(fd);
+    }
+}
+
+int main(int argc, char** argv) {
+
+    if(argc < 4) {
+        std::cerr << "usage: " << argv[0] << " <host> <port> <path> [connections=4] [depth=16] [seconds=10]\n";
+        return 1;
+    }
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(static_cast<uint16_t>(std::stoi(argv[2])));
+    if(inet_pton(AF_INET, argv[1], &addr.sin_addr) != 1) {
+        std::cerr << "host must be IPv4 address\n";
+        return 1;
+    }
+
+    std::string const path = argv[3];
+    unsigned const connections = argc > 4 ? std::stoul(argv[4]) : 4;
+    unsigned const depth = argc > 5 ? std::stoul(argv[5]) : 16;
+    unsigned const seconds = argc > 6 ? std::stoul(argv[6]) : 10;
+
+    std::string batch;
+    for(unsigned i = 0; i < depth; ++i) {
+        batch += "GET " + path + " HTTP/1.1\r\nHost: " + argv[1] + "\r\n\r\n";
+    }
+
+    std::atomic<bool> stop = false;
+    std::vector<stats_t> stats(connections);
+    std::vector<std::thread> threads;
+
+    auto const started = std::chrono::steady_clock::now();
+    for(unsigned i = 0; i < connections; ++i) {
+        threads.emplace_back([&, i]() { run(addr, batch, depth, stop, stats[i]); });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    stop = true;
+    for(auto& t: threads) t.join();
+
+    auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    stats_t total;
+    for(auto const& s: stats) {
+        total.requests += s.requests;
+        total.writes += s.writes;
+        total.reads += s.reads;
+        total.failed |= s.failed;
+    }
+
+    std::cout << "connections: " << connections << ", depth: " << depth << "\n"
+              << "requests: " << total.requests << " in " << elapsed << "s, "
+              << static_cast<double>(total.requests) / elapsed << " req/s\n"
+              << "requests per write: " << (total.writes ? static_cast<double>(total.requests) / total.writes : 0) << "\n"
+              << "responses per read: " << (total.reads ? static_cast<double>(total.requests) / total.reads : 0) << "\n";
+
+    if(total.failed) std::cout << "some connections failed or were closed by server\n";
+    return total.failed ? 2 : 0;
+}